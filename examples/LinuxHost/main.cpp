@@ -0,0 +1,825 @@
+/*
+ * ESP32MQTTClient end to end on a Linux host, against the in-process loopback broker.
+ *
+ * Runs connect, throughput, reconnect, broker restart, scripted fault, static route, minimal subscriptions, failover, flow control, duplicate filter, topic template, priority lane, chunked transfer and batched telemetry phases,
+ * and prints the timings. The exit code is 0 when every phase completed, so it can run in CI.
+ *
+ *   ./linux_host [--messages N] [--qos Q] [--mqtt5] [--verbose] [--faults "<script>"] [--trace <file>]
+ *
+ * See host/ESP32MQTTLoopbackBroker.h for the fault script syntax. --trace records the message pipeline
+ * of the whole run and writes it as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ */
+#include <stdio.h>
+#include <string>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cmath>
+
+#include "ESP32MQTTClient.h"
+#include "ESP32MQTTTelemetry.h"
+#include "ESP32MQTTTransfer.h"
+#include "ESP32MQTTTopicTemplate.h"
+#include "ESP32MQTTLoopbackBroker.h"
+
+static const char *TAG = "MAIN";
+static const std::size_t TRACE_CAPACITY = 65536; // Spans, the oldest are overwritten on longer runs
+static const char *DEFAULT_FAULTS = "out PUBACK#2 drop; out CONNACK#1 partial 2 50; in PUBLISH#5 disconnect; out PUBLISH#3 delay 100";
+
+ESP32MQTTLoopbackBroker broker;
+ESP32MQTTClient mqttClient;
+ESP32MQTTClient minimalClient; // Minimal subscriptions mode, see minimalSubscriptionsRun()
+static std::string failoverUris[3]; // addBroker() keeps the pointers: defined first, destroyed after failoverClient
+ESP32MQTTClient failoverClient; // Three brokers, see failoverRun()
+ESP32MQTTLoopbackBroker failoverBrokers[3];
+MemoryTransferSink transferSink;
+ESP32MQTTChunkSender transferSender(mqttClient, "transfer/blob");
+ESP32MQTTChunkReceiver transferReceiver(mqttClient, "transfer/blob", transferSink);
+
+static int qos = 1;
+static std::atomic<int64_t> connectedUs(0);
+static std::atomic<int64_t> disconnectedUs(0);
+static std::atomic<uint32_t> received(0);
+static std::mutex receivedMutex;
+static std::set<std::string> receivedPayloads;
+static std::atomic<uint32_t> telemetrySamples(0);
+static std::atomic<uint32_t> telemetryMalformed(0);
+static std::atomic<uint32_t> telemetryMismatches(0); // Decoded samples differing from what was sent
+static std::atomic<uint32_t> telemetryCount(0);      // Samples of the current telemetryRun()
+static std::atomic<int64_t> telemetryDecodeUs(0);
+static std::atomic<uint32_t> filteredDeliveries(0);
+static std::atomic<uint32_t> unfilteredDeliveries(0);
+static std::atomic<uint32_t> redeliveries(0); // Handled by the client, getStats() is up to date for them
+static std::atomic<bool> minimalSubscribed(false); // The client keeps its subscriptions across reconnections
+static std::atomic<uint32_t> minimalUnsubscribes(0);
+static std::atomic<uint32_t> minimalLine(0), minimalSystem(0), minimalAll(0);
+static std::mutex minimalMutex;
+static std::vector<std::string> minimalTopics; // Every message received by minimalClient
+static std::atomic<bool> failoverActive(false); // failoverClient events are handled during failoverRun() only, its drastic reset is armed
+static std::atomic<bool> failoverSubscribed(false);
+static std::atomic<uint32_t> failoverConnections(0);
+static std::atomic<uint32_t> failoverPings(0);
+static std::atomic<uint32_t> staticTemperatures(0);
+static std::atomic<uint32_t> staticAlarms(0);
+
+// Flow controlled subscriptions, one per overload policy: payloads (message numbers) in delivery order
+struct FlowDeliveries
+{
+    std::mutex mutex;
+    std::vector<int> payloads;
+    int64_t firstUs;
+    int64_t lastUs;
+};
+static const char *FLOW_TOPICS[] = {"flow/drop", "flow/latest", "flow/sample"};
+static FlowDeliveries flowDeliveries[3];
+
+static void onStaticTemperature(const char *, size_t, const char *, size_t) { staticTemperatures++; }
+static void onStaticAlarm(const char *, size_t, const char *, size_t) { staticAlarms++; }
+
+// Published and subscribed with the same template, see topicTemplateRun()
+static ESP32MQTTTopicTemplate metricTemplate("tmpl/site1", "+/+/value");
+static std::mutex templateMutex;
+static std::vector<std::string> templateMessages; // "<segment 0> <segment 1> <payload>" as parsed by the subscriber
+
+// Batched telemetry, see telemetryRun(): sample i of 4 slowly changing channels (2 decimals, 10 ms apart)
+static const int64_t TELEMETRY_EPOCH_MS = 1700000000000LL;
+static const float TELEMETRY_SCALE = 100; // TELEMETRY_VARINT
+
+static void telemetrySample(uint32_t i, float *values)
+{
+    for (int channel = 0; channel < 4; channel++)
+        values[channel] = roundf((20 + 5 * sinf(i / 200.0f + channel)) * 100) / 100;
+}
+
+// Decoded samples of a batch that are not the ones sent: values exact, within 1 / scale for TELEMETRY_VARINT, timestamps exact
+static uint32_t telemetryCheck(const std::string &payload)
+{
+    ESP32MQTTTelemetryReader reader(payload);
+    float tolerance = reader.encoding() == TELEMETRY_VARINT ? 1 / TELEMETRY_SCALE : 0;
+    int64_t timestampMs;
+    float values[ESP32MQTTTelemetryBatch::MAX_CHANNELS], sent[4];
+    uint32_t mismatches = 0;
+    while (reader.next(timestampMs, values))
+    {
+        int64_t offsetMs = timestampMs - TELEMETRY_EPOCH_MS;
+        if (reader.channels() != 4 || offsetMs < 0 || offsetMs % 10 != 0 || offsetMs / 10 >= telemetryCount)
+        {
+            mismatches++;
+            continue;
+        }
+        telemetrySample((uint32_t)(offsetMs / 10), sent);
+        for (int channel = 0; channel < 4; channel++)
+        {
+            if (fabsf(values[channel] - sent[channel]) > tolerance)
+            {
+                mismatches++;
+                break;
+            }
+        }
+    }
+    return mismatches;
+}
+
+static const ESP32MQTTStaticRoute staticRoutes[] = {
+    MQTT_STATIC_ROUTE("static/+/temperature", onStaticTemperature),
+    MQTT_STATIC_ROUTE("static/alarm/#", onStaticAlarm),
+};
+
+void onMqttConnect(esp_mqtt_client_handle_t client)
+{
+    if (mqttClient.isMyTurn(client))
+    {
+        mqttClient.subscribe("bench/#", [](const std::string &payload)
+                             {
+                                 std::lock_guard<std::mutex> lock(receivedMutex);
+                                 receivedPayloads.insert(payload);
+                                 received++;
+                             },
+                             qos);
+        mqttClient.subscribe("telemetry/#", [](const std::string &payload)
+                             {
+                                 int64_t start = esp_timer_get_time();
+                                 ESP32MQTTTelemetryReader reader(payload);
+                                 int64_t timestampMs;
+                                 float values[ESP32MQTTTelemetryBatch::MAX_CHANNELS];
+                                 uint32_t samples = 0;
+                                 while (reader.next(timestampMs, values))
+                                     samples++;
+                                 telemetryDecodeUs += esp_timer_get_time() - start;
+                                 telemetryMismatches += telemetryCheck(payload);
+                                 telemetrySamples += samples;
+                                 if (!reader.isValid())
+                                     telemetryMalformed++;
+                             },
+                             qos);
+        for (int i = 0; i < 3; i++)
+        {
+            mqttClient.subscribe(FLOW_TOPICS[i], [i](const std::string &payload)
+                                 {
+                                     std::lock_guard<std::mutex> lock(flowDeliveries[i].mutex);
+                                     flowDeliveries[i].lastUs = esp_timer_get_time();
+                                     if (flowDeliveries[i].payloads.empty())
+                                         flowDeliveries[i].firstUs = flowDeliveries[i].lastUs;
+                                     flowDeliveries[i].payloads.push_back(atoi(payload.c_str()));
+                                 });
+        }
+        transferSender.begin();
+        transferReceiver.begin();
+        mqttClient.subscribeStatic(staticRoutes, 1); // Every route of the table, at QoS 1
+        mqttClient.subscribe("dup/data", [](const std::string &) { filteredDeliveries++; }, 1);
+        mqttClient.subscribe("dup/#", [](const std::string &) { unfilteredDeliveries++; }, 1);
+        mqttClient.subscribe("dupother/#", [](const std::string &) {}, 1); // Opted out, never matches the redeliveries
+        mqttClient.subscribe(metricTemplate.filter(), [](const std::string &topic, const std::string &payload)
+                             {
+                                 ESP32MQTTTopicTemplate::Segment segments[ESP32MQTTTopicTemplate::MAX_SEGMENTS];
+                                 std::lock_guard<std::mutex> lock(templateMutex);
+                                 if (metricTemplate.parse(topic, segments))
+                                     templateMessages.push_back(topic.substr(segments[0].offset, segments[0].length) + " " +
+                                                                topic.substr(segments[1].offset, segments[1].length) + " " + payload);
+                             },
+                             1);
+    }
+    else if (minimalClient.isMyTurn(client) && !minimalSubscribed.exchange(true))
+    {
+        minimalClient.subscribe("plant/line1/+", [](const std::string &) { minimalLine++; }, 0);
+        minimalClient.subscribe("$SYS/uptime", [](const std::string &) { minimalSystem++; }, 1);
+        minimalClient.subscribe("#", [](const std::string &) { minimalAll++; }, 0);
+    }
+    else if (failoverClient.isMyTurn(client) && !failoverSubscribed.exchange(true))
+    {
+        failoverClient.subscribe("failover/ping", [](const std::string &) { failoverPings++; }, 1); // Restored on each broker switch
+    }
+}
+
+void handleMQTT(void * /* handler_args */, esp_event_base_t /* base */, int32_t /* event_id */, void *event_data)
+{
+    auto *event = static_cast<esp_mqtt_event_handle_t>(event_data);
+
+    // In the order the clients start: loopStart() writes the handle of a later one while the earlier ones run
+    if (mqttClient.isMyTurn(event->client))
+    {
+        if (event->event_id == MQTT_EVENT_CONNECTED)
+            connectedUs = esp_timer_get_time();
+        else if (event->event_id == MQTT_EVENT_DISCONNECTED && disconnectedUs == 0)
+            disconnectedUs = esp_timer_get_time();
+        mqttClient.onEventCallback(event);
+        if (event->event_id == MQTT_EVENT_DATA && event->dup)
+            redeliveries++;
+    }
+    else if (minimalClient.isMyTurn(event->client))
+    {
+        minimalClient.onEventCallback(event);
+        if (event->event_id == MQTT_EVENT_UNSUBSCRIBED)
+            minimalUnsubscribes++;
+    }
+    else if (failoverClient.isMyTurn(event->client) && failoverActive)
+    {
+        failoverClient.onEventCallback(event);
+        if (event->event_id == MQTT_EVENT_CONNECTED)
+            failoverConnections++;
+    }
+}
+
+static bool waitFor(std::function<bool()> condition, uint32_t timeoutMs)
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeoutMs * 1000;
+    while (!condition())
+    {
+        if (esp_timer_get_time() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+static void resetReceived()
+{
+    std::lock_guard<std::mutex> lock(receivedMutex);
+    receivedPayloads.clear();
+    received = 0;
+}
+
+// Payloads of one publishAndWait() run: QoS 2 messages of an earlier run may still be redelivered after a reconnection
+static std::size_t uniqueReceived(const char *name)
+{
+    std::string prefix = std::string(name) + " ";
+    std::lock_guard<std::mutex> lock(receivedMutex);
+    std::size_t count = 0;
+    for (std::set<std::string>::const_iterator it = receivedPayloads.lower_bound(prefix); it != receivedPayloads.end() && it->compare(0, prefix.size(), prefix) == 0; ++it)
+        count++;
+    return count;
+}
+
+// Publish count numbered messages and wait until each of them came back once at least
+static bool publishAndWait(const char *name, int count, uint32_t timeoutMs, double &elapsedMs)
+{
+    resetReceived();
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < count; i++)
+    {
+        char payload[32];
+        snprintf(payload, sizeof(payload), "%s %08d", name, i);
+        if (!mqttClient.publish("bench/data", payload, qos, false))
+            ESP_LOGW(TAG, "publish %d refused", i);
+    }
+    bool complete = waitFor([=]() { return uniqueReceived(name) == (std::size_t)count; }, timeoutMs);
+    elapsedMs = (esp_timer_get_time() - start) / 1000.0;
+    return complete;
+}
+
+// Batch count samples of 4 slowly changing channels (2 decimals, 10 ms apart), and wait for the subscriber to decode and check them
+static bool telemetryRun(const char *name, TelemetryEncoding encoding, uint32_t count)
+{
+    char topic[32], label[32];
+    snprintf(topic, sizeof(topic), "telemetry/%s", name);
+    snprintf(label, sizeof(label), "%s batch", name);
+    ESP32MQTTTelemetryBatch batch(mqttClient, topic, 4, encoding, 0);
+    batch.setQos(qos);
+    if (encoding == TELEMETRY_VARINT)
+        batch.setScale(TELEMETRY_SCALE);
+
+    telemetryCount = count;
+    telemetrySamples = 0;
+    telemetryMalformed = 0;
+    telemetryMismatches = 0;
+    telemetryDecodeUs = 0;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        float values[4];
+        telemetrySample(i, values);
+        batch.add(TELEMETRY_EPOCH_MS + i * 10, values);
+    }
+    batch.flush();
+    double addUs = (double)(esp_timer_get_time() - start) / count;
+
+    bool complete = waitFor([count]() { return telemetrySamples >= count; }, 10000) && telemetryMalformed == 0 && telemetryMismatches == 0 &&
+                    batch.getStats().failedBatches == 0;
+    const ESP32MQTTTelemetryBatch::Stats &stats = batch.getStats();
+    printf("%-16s %s %u samples x 4 in %u batches, %u mismatched, %.2f bytes/sample, %.2f us/sample add+publish, %.2f us/sample decode\n", label,
+           complete ? "ok  " : "FAIL", (unsigned)telemetrySamples, stats.batches, (unsigned)telemetryMismatches, (double)stats.payloadBytes / count, addUs,
+           (double)telemetryDecodeUs / count);
+    return complete;
+}
+
+// Time from the connection loss to the next CONNECTED event
+static bool measureReconnect(std::function<void()> breakConnection, double &reconnectMs)
+{
+    disconnectedUs = 0;
+    int64_t previous = connectedUs;
+    breakConnection();
+    bool reconnected = waitFor([previous]() { return disconnectedUs != 0 && connectedUs != previous; }, 10000);
+    reconnectMs = (connectedUs - disconnectedUs) / 1000.0;
+    return reconnected;
+}
+
+// Burst messages at a subscription paced at 50 msg/s with 4 waiting at most, and check what the overload policy kept
+static bool flowControlRun(const char *label, OverloadPolicy policy, uint32_t &dropped)
+{
+    const int count = 20, depth = 4, rate = 50, sampleEvery = 5;
+    FlowDeliveries &deliveries = flowDeliveries[policy];
+    const char *topic = FLOW_TOPICS[policy];
+    if (!mqttClient.setFlowControl(topic, rate, depth, policy, sampleEvery))
+        return false;
+    for (int i = 0; i < count; i++)
+        broker.publish(topic, std::to_string(i));
+
+    ESP32MQTTClient::SubscriptionStats stats;
+    bool complete = waitFor([&]()
+                            {
+                                std::lock_guard<std::mutex> lock(deliveries.mutex);
+                                return mqttClient.getSubscriptionStats(topic, stats) && stats.queued == 0 &&
+                                       stats.delivered + stats.dropped == (uint32_t)count && deliveries.payloads.size() == stats.delivered;
+                            }, 5000);
+
+    std::lock_guard<std::mutex> lock(deliveries.mutex);
+    const std::vector<int> &payloads = deliveries.payloads;
+    double intervalMs = payloads.size() > 1 ? (deliveries.lastUs - deliveries.firstUs) / 1000.0 / (payloads.size() - 1) : 0;
+    complete = complete && stats.dropped > 0 && stats.queueHighWater == depth && payloads.size() >= depth && intervalMs >= 1000.0 / rate - 1;
+    for (std::size_t i = 1; i < payloads.size() && complete; i++)
+        complete = payloads[i] > payloads[i - 1];
+    if (complete && policy == OVERLOAD_DROP)
+    {
+        // The first arrivals fill the queue, the overload is dropped
+        for (int i = 0; i < depth && complete; i++)
+            complete = payloads[i] == i;
+    }
+    else if (complete && policy == OVERLOAD_KEEP_LATEST)
+    {
+        // The queue always holds the latest arrivals
+        for (int i = 0; i < depth && complete; i++)
+            complete = payloads[payloads.size() - depth + i] == count - depth + i;
+    }
+    else if (complete && policy == OVERLOAD_SAMPLE)
+    {
+        // One of every sampleEvery overloads replaces the oldest queued message, the others are skipped
+        bool skipped = false;
+        for (std::size_t i = 1; i < payloads.size(); i++)
+            skipped |= payloads[i] - payloads[i - 1] > 1;
+        complete = skipped && payloads.back() >= count - sampleEvery;
+    }
+
+    printf("%-16s %s %u delivered, %u dropped, high water %u, %.1f ms apart, last %d\n", label, complete ? "ok  " : "FAIL",
+           stats.delivered, stats.dropped, stats.queueHighWater, intervalMs, payloads.empty() ? -1 : payloads.back());
+    dropped += stats.dropped;
+    return complete;
+}
+
+// Send a blob in 1 KB chunks with the given window while the broker loses some of the chunks and acks on the way
+static bool transferRun(uint8_t window, const std::string &blob)
+{
+    char label[32];
+    snprintf(label, sizeof(label), "transfer w=%u", (unsigned)window);
+    transferSender.setWindow(window);
+    transferSender.setChunkSize(1024);
+    transferSender.setRetransmitTimeout(100);
+    transferReceiver.setWindow(window);
+
+    ESP32MQTTChunkReceiver::Stats before = transferReceiver.getStats();
+    uint32_t faultsFired = broker.getStats().faultsFired;
+    broker.addFaults("out PUBLISH#3 drop; out PUBLISH#10 drop; out PUBLISH#11 drop; out PUBLISH#25 drop; out PUBLISH#47 drop; out PUBLISH#60 drop");
+    MemoryTransferSource source(reinterpret_cast<const uint8_t *>(blob.data()), blob.size());
+    bool sent = transferSender.send(source, blob.size(), 20000);
+    broker.clearFaults();
+
+    // The receiver verified each chunk CRC and the blob SHA-256 before its final ack
+    const ESP32MQTTChunkReceiver::Stats &stats = transferReceiver.getStats();
+    bool complete = sent && stats.transfersCompleted == before.transfersCompleted + 1 && stats.transfersFailed == before.transfersFailed &&
+                    stats.crcErrors == before.crcErrors && transferSink.data() == blob;
+    const ESP32MQTTChunkSender::Stats &senderStats = transferSender.getStats();
+    printf("%-16s %s %u KB in %u ms, %.0f KB/s, %u lost, %u chunks sent, %u retransmitted\n", label, complete ? "ok  " : "FAIL",
+           (unsigned)(blob.size() / 1024), senderStats.elapsedMs, blob.size() / 1024.0 * 1000 / (senderStats.elapsedMs ? senderStats.elapsedMs : 1),
+           broker.getStats().faultsFired - faultsFired, senderStats.chunksSent, senderStats.retransmissions);
+    return complete;
+}
+
+static std::size_t minimalReceived(const std::string &topic)
+{
+    std::lock_guard<std::mutex> lock(minimalMutex);
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < minimalTopics.size(); i++)
+        count += minimalTopics[i] == topic;
+    return count;
+}
+
+// A second client in minimal subscriptions mode: "#" covers "plant/line1/+" but not "$SYS/uptime",
+// and a covering subscription stays on the broker until what it covered is acknowledged on its own
+static bool minimalSubscriptionsRun(const std::string &uri)
+{
+    minimalClient.enableMinimalSubscriptions();
+    minimalClient.setURI(uri.c_str());
+    minimalClient.setMqttClientName("linux-host-minimal");
+    minimalClient.setKeepAlive(5);
+    minimalClient.setReconnectTimeout(100);
+    minimalClient.setOnMessageCallback([](const std::string &topic, const std::string &)
+                                       {
+                                           std::lock_guard<std::mutex> lock(minimalMutex);
+                                           minimalTopics.push_back(topic);
+                                       });
+    if (!minimalClient.loopStart() || !waitFor([]() { return minimalClient.isConnected(); }, 5000))
+        return false;
+
+    // Subscribed in onMqttConnect(): "plant/line1/+" goes once "#" is acknowledged, "$SYS/uptime" stays
+    bool complete = waitFor([]() { return minimalUnsubscribes == 1; }, 5000);
+    broker.publish("$SYS/uptime", "42", 1);
+    broker.publish("plant/line1/temperature", "21.5");
+    broker.publish("misc/first", "1");
+    complete = complete && waitFor([]() { return minimalSystem == 1 && minimalLine == 1 && minimalAll == 2; }, 5000);
+
+    // The broker loses the SUBSCRIBE replacing "#", which must cover "plant/line1/+" until the retransmission is acknowledged
+    uint32_t faultsFired = broker.getStats().faultsFired;
+    broker.addFaults("in SUBSCRIBE#1 drop");
+    minimalClient.unsubscribe("#");
+    complete = complete && waitFor([=]() { return broker.getStats().faultsFired == faultsFired + 1; }, 5000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50)); // An early UNSUBSCRIBE would be handled by now
+    broker.publish("plant/line1/temperature", "21.6");
+    complete = complete && waitFor([]() { return minimalLine == 2; }, 5000);
+
+    // Then "#" leaves the broker
+    complete = complete && waitFor([]() { return minimalUnsubscribes == 2; }, 5000);
+    broker.publish("misc/second", "2");
+    broker.publish("plant/line1/temperature", "21.7");
+    complete = complete && waitFor([]() { return minimalLine == 3; }, 5000) && minimalReceived("misc/second") == 0 &&
+               minimalReceived("$SYS/uptime") == 1;
+    printf("%-16s %s %u line1, %u $SYS, %u #, %u unsubscribed\n", "minimal subs", complete ? "ok  " : "FAIL", (unsigned)minimalLine,
+           (unsigned)minimalSystem, (unsigned)minimalAll, (unsigned)minimalUnsubscribes);
+    return complete;
+}
+
+// Publish on a failover broker until failoverClient gets it, its SUBSCRIBE may still be on the way after a switch
+static bool failoverPing(ESP32MQTTLoopbackBroker &target)
+{
+    uint32_t pings = failoverPings;
+    for (int attempt = 0; attempt < 20; attempt++)
+    {
+        target.publish("failover/ping", "1", 1);
+        if (waitFor([=]() { return failoverPings > pings; }, 250))
+            return true;
+    }
+    return false;
+}
+
+// Three brokers, failoverClient starts on the only one up. When it stops, the client fails over to one of the
+// others, which answer CONNECT late, and migrates back once it is up again. Reconnecting to it must not count as
+// a connection failure: the drastic reset is armed for that part
+static bool failoverRun()
+{
+    static const uint32_t CONNACK_DELAY_MS[3] = {0, 100, 200};
+    static const int RECONNECT_TIMEOUT_MS = 1000; // Migrating back must not wait for it
+    uint16_t ports[3];
+    for (int i = 0; i < 3; i++)
+    {
+        if (!failoverBrokers[i].start())
+            return false;
+        ports[i] = failoverBrokers[i].port();
+        failoverUris[i] = failoverBrokers[i].uri();
+        failoverClient.addBroker(failoverUris[i].c_str());
+        if (i > 0)
+            failoverBrokers[i].stop(); // Unreachable when probed by loopStart(), the first broker is the preferred one
+    }
+    failoverClient.setMqttClientName("linux-host-failover");
+    failoverClient.setKeepAlive(5);
+    failoverClient.setReconnectTimeout(RECONNECT_TIMEOUT_MS);
+    failoverClient.setFailoverThreshold(1); // The connection loss itself, not a reconnection attempt RECONNECT_TIMEOUT_MS later
+    failoverClient.setBrokerRecheckInterval(200);
+    failoverActive = true;
+    bool complete = failoverClient.loopStart() && waitFor([]() { return failoverClient.isConnected(); }, 5000) &&
+                    failoverClient.getCurrentBroker() == 0 && failoverPing(failoverBrokers[0]);
+
+    // The backup brokers come up with CONNACK delays, then the preferred one goes down
+    for (int i = 1; i < 3; i++)
+    {
+        char fault[32];
+        snprintf(fault, sizeof(fault), "out CONNACK delay %u", (unsigned)CONNACK_DELAY_MS[i]);
+        complete = complete && failoverBrokers[i].start(ports[i]) && failoverBrokers[i].addFaults(fault);
+    }
+    uint32_t connections = failoverConnections;
+    int64_t start = esp_timer_get_time();
+    failoverBrokers[0].stop();
+    complete = complete && waitFor([=]() { return failoverConnections > connections; }, 5000);
+    double failoverMs = (esp_timer_get_time() - start) / 1000.0;
+    int backup = failoverClient.getCurrentBroker();
+    complete = complete && backup > 0 && failoverClient.getBrokerConnackTime(backup) >= (int32_t)CONNACK_DELAY_MS[backup] * 1000 &&
+               failoverPing(failoverBrokers[backup]);
+
+    // Migrate back
+    failoverClient.enableDrasticResetOnConnectionFailures();
+    connections = failoverConnections;
+    start = esp_timer_get_time();
+    complete = complete && failoverBrokers[0].start(ports[0]) && waitFor([=]() { return failoverConnections > connections; }, 5000);
+    double backMs = (esp_timer_get_time() - start) / 1000.0;
+    complete = complete && backMs < RECONNECT_TIMEOUT_MS && failoverClient.getCurrentBroker() == 0 && failoverPing(failoverBrokers[0]) &&
+               failoverClient.getStats().brokerSwitches == 2;
+    failoverActive = false;
+    printf("%-16s %s to broker %d in %.1f ms (CONNACK %.1f ms), back in %.1f ms, %u switches\n", "failover", complete ? "ok  " : "FAIL",
+           backup, failoverMs, backup > 0 ? failoverClient.getBrokerConnackTime(backup) / 1000.0 : 0.0, backMs,
+           failoverClient.getStats().brokerSwitches);
+    return complete;
+}
+
+// A bulk backlog through the shaped lane while critical messages and plain publish() calls go out: the critical
+// lane must not wait behind it, and every in-flight slot must be given back, whoever's acks come first
+static bool lanesRun()
+{
+    static const int BULK = 100, CRITICAL = 20;
+    static const uint32_t CRITICAL_DELAY_LIMIT_US = 50000;
+    static const uint32_t BULK_RATE = 100 * 1024;
+    resetReceived();
+    mqttClient.setBulkRate(BULK_RATE, 4096);
+    std::string filler(512, '.');
+    bool queued = true;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < BULK; i++)
+    {
+        char payload[32];
+        snprintf(payload, sizeof(payload), "bulk %08d ", i);
+        queued &= mqttClient.publish(PRIORITY_BULK, "bench/lanes", payload + filler, qos);
+    }
+    for (int i = 0; i < CRITICAL; i++)
+    {
+        char payload[32];
+        snprintf(payload, sizeof(payload), "critical %08d", i);
+        queued &= mqttClient.publish(PRIORITY_CRITICAL, "bench/lanes", payload, qos);
+        snprintf(payload, sizeof(payload), "plain %08d", i);
+        queued &= mqttClient.publish("bench/lanes", payload, qos);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    ESP32MQTTClient::PublishLaneStats critical, bulk;
+    bool complete = queued && waitFor([]() { return uniqueReceived("bulk") == BULK && uniqueReceived("critical") == CRITICAL &&
+                                                    uniqueReceived("plain") == CRITICAL; }, 10000);
+    double elapsedMs = (esp_timer_get_time() - start) / 1000.0;
+    complete = complete && waitFor([&]() { return mqttClient.getPublishLaneStats(PRIORITY_CRITICAL, critical) && critical.inflight == 0 &&
+                                                  mqttClient.getPublishLaneStats(PRIORITY_BULK, bulk) && bulk.inflight == 0; }, 5000);
+    mqttClient.setBulkRate(0);
+    complete = complete && critical.sent == CRITICAL && bulk.sent == BULK && critical.dropped == 0 && bulk.dropped == 0 &&
+               critical.maxDelayUs <= CRITICAL_DELAY_LIMIT_US;
+    printf("%-16s %s critical queued %.2f ms max (limit %.0f), bulk %.0f ms avg, %.0f KB/s for %.0f KB/s shaping\n", "lanes",
+           complete ? "ok  " : "FAIL", critical.maxDelayUs / 1000.0, CRITICAL_DELAY_LIMIT_US / 1000.0, bulk.avgDelayUs / 1000.0,
+           BULK * (filler.size() + 14) / 1024.0 * 1000 / elapsedMs, BULK_RATE / 1024.0);
+    return complete;
+}
+
+// A slow bulk bucket while critical publishes wake the outbound task every 200 us: bulk must still get its rate
+static bool lanesShapingRun()
+{
+    static const int BULK = 40;
+    static const uint32_t RATE = 2000, BURST = 200, DURATION_US = 1000000;
+    static const std::size_t COST = 100; // Topic and payload bytes of a bulk message
+    std::string filler(COST - strlen("bench/lanes") - strlen("slow 0000 "), '.');
+    mqttClient.setBulkRate(RATE, BURST);
+    bool queued = true;
+    for (int i = 0; i < BULK; i++)
+    {
+        char payload[16];
+        snprintf(payload, sizeof(payload), "slow %04d ", i);
+        queued &= mqttClient.publish(PRIORITY_BULK, "bench/lanes", payload + filler, qos);
+    }
+
+    ESP32MQTTClient::PublishLaneStats bulk;
+    mqttClient.getPublishLaneStats(PRIORITY_BULK, bulk);
+    uint32_t sentBefore = bulk.sent;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; esp_timer_get_time() - start < DURATION_US; i++)
+    {
+        char payload[32];
+        snprintf(payload, sizeof(payload), "flood %08u", (unsigned)i);
+        mqttClient.publish(PRIORITY_CRITICAL, "bench/lanes", payload, qos); // The critical lane may be full, only the wake-ups matter
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    mqttClient.getPublishLaneStats(PRIORITY_BULK, bulk);
+    int64_t elapsedUs = esp_timer_get_time() - start;
+    uint32_t shaped = bulk.sent - sentBefore;
+    double expected = (BURST + (double)RATE * elapsedUs / 1000000) / COST;
+
+    // Let the rest go unshaped
+    mqttClient.setBulkRate(0);
+    bool complete = queued && shaped >= expected * 0.8 && shaped <= expected + 1 &&
+                    waitFor([]() { return uniqueReceived("slow") == BULK; }, 10000);
+    printf("%-16s %s %u bulk messages in %.0f ms under critical traffic, %.1f expected at %u B/s\n", "lanes shaping",
+           complete ? "ok  " : "FAIL", (unsigned)shaped, elapsedUs / 1000.0, expected, (unsigned)RATE);
+    return complete;
+}
+
+// Topic templates: format() with each integer type, the values set() must refuse, parse(), and what publish() sends
+static bool topicTemplateRun()
+{
+    ESP32MQTTTopicTemplate &metric = metricTemplate;
+    bool complete = metric.isValid() && metric.filter() == "tmpl/site1/+/+/value" && metric.segmentCount() == 2;
+
+    std::size_t channel = 7;
+    const char *topic = metric.format("line1", 5u);
+    complete = complete && topic != nullptr && strcmp(topic, "tmpl/site1/line1/5/value") == 0;
+    topic = metric.format(channel, -12L);
+    complete = complete && topic != nullptr && strcmp(topic, "tmpl/site1/7/-12/value") == 0;
+    topic = metric.format((uint64_t)UINT64_MAX, (int64_t)INT64_MIN);
+    complete = complete && topic != nullptr && strcmp(topic, "tmpl/site1/18446744073709551615/-9223372036854775808/value") == 0;
+
+    // Not a plain topic level, or no such segment: the topic stays as it was
+    std::string before = metric.c_str();
+    int refused = !metric.set(0, "a/b") + !metric.set(0, "line+") + !metric.set(1, "#") + !metric.set(1, std::string("a\0b", 3)) +
+                  !metric.set(2, "x");
+    complete = complete && refused == 5 && before == metric.c_str() && metric.length() == before.size();
+
+    ESP32MQTTTopicTemplate::Segment segments[ESP32MQTTTopicTemplate::MAX_SEGMENTS];
+    std::string received = "tmpl/site1/line2/temperature/value";
+    complete = complete && metric.parse(received, segments) && received.compare(segments[0].offset, segments[0].length, "line2") == 0 &&
+               received.compare(segments[1].offset, segments[1].length, "temperature") == 0 &&
+               !metric.parse(std::string("tmpl/site1/line2/value"), segments) && !metric.parse(std::string("tmpl/site1/a/b/value/c"), segments);
+
+    // An unset segment would publish to another topic
+    ESP32MQTTTopicTemplate partial("tmpl/site1", "+/+/value");
+    complete = complete && partial.set(0, "line3") && !partial.publish(mqttClient, "0", 1);
+
+    complete = complete && metric.format("line3", (unsigned long)42) != nullptr && metric.publish(mqttClient, "21.5", 1) &&
+               waitFor([]() { std::lock_guard<std::mutex> lock(templateMutex); return !templateMessages.empty(); }, 5000);
+    std::string message;
+    {
+        std::lock_guard<std::mutex> lock(templateMutex);
+        message = templateMessages.empty() ? "" : templateMessages[0];
+        complete = complete && templateMessages.size() == 1 && message == "line3 42 21.5";
+    }
+    printf("%-16s %s %s, %d values refused, received \"%s\"\n", "topic templates", complete ? "ok  " : "FAIL", metric.c_str(), refused,
+           message.c_str());
+    return complete;
+}
+
+// Lose the PUBACK of a QoS 1 message from the broker, and reconnect: the resumed session redelivers it with DUP set
+static bool redeliver(const char *payload)
+{
+    uint32_t filtered = filteredDeliveries, unfiltered = unfilteredDeliveries;
+    uint32_t faultsFired = broker.getStats().faultsFired;
+    broker.addFaults("in PUBACK#1 drop");
+    broker.publish("dup/data", payload, 1);
+    bool delivered = waitFor([=]() { return filteredDeliveries == filtered + 1 && unfilteredDeliveries == unfiltered + 1 &&
+                                            broker.getStats().faultsFired == faultsFired + 1; }, 5000);
+    double reconnectMs;
+    return delivered && measureReconnect([]() { broker.disconnectClients(); }, reconnectMs);
+}
+
+int main(int argc, char **argv)
+{
+    int messages = 2000;
+    bool mqtt5 = false;
+    const char *faults = DEFAULT_FAULTS;
+    const char *tracePath = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--messages" && i + 1 < argc)
+            messages = atoi(argv[++i]);
+        else if (arg == "--qos" && i + 1 < argc)
+            qos = atoi(argv[++i]);
+        else if (arg == "--faults" && i + 1 < argc)
+            faults = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (arg == "--mqtt5")
+            mqtt5 = true;
+        else if (arg == "--verbose")
+            mqttClient.enableDebuggingMessages();
+        else
+        {
+            fprintf(stderr, "usage: %s [--messages N] [--qos Q] [--mqtt5] [--verbose] [--faults \"<script>\"] [--trace <file>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (!broker.start())
+        return 1;
+
+    std::string uri = broker.uri(); // setURI() keeps the pointer
+    mqttClient.setURI(uri.c_str());
+    mqttClient.setMqttClientName("linux-host");
+    mqttClient.setKeepAlive(5);
+    mqttClient.setReconnectTimeout(100);
+    mqttClient.setMaxPacketSize(4096);
+    mqttClient.enableDuplicateFilter();
+    mqttClient.disablePersistence(); // The broker keeps the session, and redelivers what was not acknowledged
+    if (mqtt5)
+        mqttClient.setReceiveMaximum(32); // Switches the client to MQTT 5 when built with CONFIG_MQTT_PROTOCOL_5
+    if (tracePath)
+        mqttClient.enableTracing(TRACE_CAPACITY);
+
+    bool ok = true;
+    printf("ESP32MQTTClient on %s, %d messages, QoS %d%s\n", uri.c_str(), messages, qos, mqtt5 ? ", MQTT 5" : "");
+
+    // Connect
+    int64_t start = esp_timer_get_time();
+    bool connected = mqttClient.loopStart() && waitFor([]() { return mqttClient.isConnected(); }, 5000);
+    printf("%-16s %s %.2f ms\n", "connect", connected ? "ok  " : "FAIL", (connectedUs - start) / 1000.0);
+    if (!connected)
+        return 1;
+    waitFor([]() { return broker.getStats().packetsIn >= 2; }, 1000); // CONNECT and SUBSCRIBE
+
+    // Throughput, the messages loop back through the broker
+    double elapsedMs;
+    bool complete = publishAndWait("bench", messages, 30000, elapsedMs);
+    printf("%-16s %s %d msgs in %.1f ms, %.0f msg/s, %.1f us/msg\n", "throughput", complete ? "ok  " : "FAIL",
+           (int)uniqueReceived("bench"), elapsedMs, uniqueReceived("bench") * 1000.0 / elapsedMs, elapsedMs * 1000.0 / messages);
+    ok &= complete;
+
+    // Connection dropped by the broker
+    double reconnectMs;
+    bool reconnected = measureReconnect([]() { broker.disconnectClients(); }, reconnectMs);
+    printf("%-16s %s %.2f ms\n", "reconnect", reconnected ? "ok  " : "FAIL", reconnectMs);
+    ok &= reconnected;
+
+    // Broker down for a while, the client retries every reconnect timeout
+    reconnected = measureReconnect([]()
+                                   {
+                                       uint16_t port = broker.port();
+                                       broker.stop();
+                                       std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                                       broker.start(port);
+                                   },
+                                   reconnectMs);
+    printf("%-16s %s %.2f ms (300 ms down)\n", "broker restart", reconnected ? "ok  " : "FAIL", reconnectMs);
+    ok &= reconnected;
+
+    // Scripted faults, every message must still arrive
+    int faulty = 20;
+    ESP32MQTTLoopbackBroker::Stats before = broker.getStats();
+    if (!broker.addFaults(faults))
+        return 2;
+    waitFor([]() { return mqttClient.isConnected(); }, 5000);
+    complete = publishAndWait("fault", faulty, 20000, elapsedMs);
+    broker.clearFaults();
+    printf("%-16s %s %u fired, %d/%d received (%u deliveries, %u duplicates dropped) in %.1f ms\n", "faults", complete ? "ok  " : "FAIL",
+           broker.getStats().faultsFired - before.faultsFired, (int)uniqueReceived("fault"), faulty, (unsigned)received,
+           mqttClient.getStats().duplicatesDropped, elapsedMs);
+    ok &= complete;
+
+    // Static routes, each route of the table is subscribed
+    broker.publish("static/boiler/temperature", "21.5", 1);
+    broker.publish("static/alarm/boiler/overheat", "1", 1);
+    complete = waitFor([]() { return staticTemperatures == 1 && staticAlarms == 1; }, 5000);
+    printf("%-16s %s %u temperature, %u alarm\n", "static routes", complete ? "ok  " : "FAIL", (unsigned)staticTemperatures, (unsigned)staticAlarms);
+    ok &= complete;
+
+    // Minimal subscriptions, on a second client
+    ok &= minimalSubscriptionsRun(uri);
+
+    // Failover between three brokers, on a third client
+    ok &= failoverRun();
+
+    // Flow control, a burst beyond the queue depth under each overload policy
+    uint32_t inboundDropped = mqttClient.getStats().inboundDropped, flowDropped = 0;
+    ok &= flowControlRun("flow drop", OVERLOAD_DROP, flowDropped);
+    ok &= flowControlRun("flow keep latest", OVERLOAD_KEEP_LATEST, flowDropped);
+    ok &= flowControlRun("flow sample", OVERLOAD_SAMPLE, flowDropped);
+    if (mqttClient.getStats().inboundDropped - inboundDropped != flowDropped)
+    {
+        printf("%-16s FAIL %u dropped in total, %u by the subscriptions\n", "flow control", mqttClient.getStats().inboundDropped - inboundDropped, flowDropped);
+        ok = false;
+    }
+
+    // Duplicate filter, "dup/#" opted out: it sees the redelivery, which is then not counted as dropped
+    uint32_t dropped = mqttClient.getStats().duplicatesDropped;
+    mqttClient.setDuplicateFilter("dup/#", false);
+    uint32_t redelivered = redeliveries;
+    complete = redeliver("opted out") && waitFor([=]() { return redeliveries > redelivered; }, 5000) && unfilteredDeliveries == 2 &&
+               filteredDeliveries == 1 && mqttClient.getStats().duplicatesDropped == dropped;
+    // Both filtered, the redelivery is dropped and counted, whatever subscriptions of other topics opted out
+    mqttClient.setDuplicateFilter("dup/#", true);
+    mqttClient.setDuplicateFilter("dupother/#", false);
+    redelivered = redeliveries;
+    complete = complete && redeliver("filtered") && waitFor([=]() { return redeliveries > redelivered; }, 5000) &&
+               mqttClient.getStats().duplicatesDropped == dropped + 1 && filteredDeliveries == 2 && unfilteredDeliveries == 3;
+    printf("%-16s %s %u/%u deliveries filtered/opted out, %u duplicates dropped\n", "duplicates", complete ? "ok  " : "FAIL",
+           (unsigned)filteredDeliveries, (unsigned)unfilteredDeliveries, mqttClient.getStats().duplicatesDropped - dropped);
+    ok &= complete;
+
+    // Topic templates, formatted, refused, parsed and published
+    ok &= topicTemplateRun();
+
+    // Priority lanes, critical messages past a shaped bulk backlog
+    ok &= lanesRun();
+    ok &= lanesShapingRun();
+
+    // Chunked transfer, window sweep under packet loss
+    std::string blob(64 * 1024, 0);
+    for (std::size_t i = 0; i < blob.size(); i++)
+        blob[i] = (char)((i * 2654435761u) >> 13);
+    static const uint8_t windows[] = {1, 4, 8, 32};
+    for (std::size_t i = 0; i < sizeof(windows); i++)
+        ok &= transferRun(windows[i], blob);
+
+    // Batched telemetry, bytes per sample and encoding cost of each encoding
+    ok &= telemetryRun("float32", TELEMETRY_FLOAT32, messages * 10);
+    ok &= telemetryRun("varint", TELEMETRY_VARINT, messages * 10);
+    ok &= telemetryRun("gorilla", TELEMETRY_GORILLA, messages * 10);
+
+    if (tracePath)
+    {
+        bool exported = mqttClient.exportTraceToFile(tracePath);
+        printf("%-16s %s %s\n", "trace", exported ? "ok  " : "FAIL", tracePath);
+        ok &= exported;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <sys/socket.h>
+#include <errno.h>
+
+/*
+ * MQTT 3.1.1 / 5 packet helpers shared by the host transport and the loopback broker.
+ *
+ * Only what the client library exchanges with a broker: no AUTH packet, MQTT 5 properties are
+ * skipped on read and only written where the client sets one.
+ */
+
+enum MqttPacketType : uint8_t
+{
+    MQTT_PACKET_CONNECT = 1,
+    MQTT_PACKET_CONNACK,
+    MQTT_PACKET_PUBLISH,
+    MQTT_PACKET_PUBACK,
+    MQTT_PACKET_PUBREC,
+    MQTT_PACKET_PUBREL,
+    MQTT_PACKET_PUBCOMP,
+    MQTT_PACKET_SUBSCRIBE,
+    MQTT_PACKET_SUBACK,
+    MQTT_PACKET_UNSUBSCRIBE,
+    MQTT_PACKET_UNSUBACK,
+    MQTT_PACKET_PINGREQ,
+    MQTT_PACKET_PINGRESP,
+    MQTT_PACKET_DISCONNECT
+};
+
+static constexpr uint8_t MQTT_PROTOCOL_LEVEL_311 = 4;
+static constexpr uint8_t MQTT_PROTOCOL_LEVEL_5 = 5;
+
+inline void mqttPut16(std::string &out, uint16_t value)
+{
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+inline void mqttPutVarint(std::string &out, uint32_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        out += (char)(value ? byte | 0x80 : byte);
+    } while (value);
+}
+
+inline void mqttPutString(std::string &out, const char *data, std::size_t length)
+{
+    mqttPut16(out, (uint16_t)length);
+    out.append(data, length);
+}
+
+/**
+ * Prepend the fixed header to a packet body
+ *
+ * @param header is the first byte: packet type << 4 | flags
+ * @param body is the variable header and payload
+ * @return the complete packet
+ */
+inline std::string mqttPacket(uint8_t header, const std::string &body)
+{
+    std::string packet(1, (char)header);
+    mqttPutVarint(packet, body.size());
+    packet += body;
+    return packet;
+}
+
+inline std::string mqttAckPacket(uint8_t type, uint16_t packetId)
+{
+    std::string body;
+    mqttPut16(body, packetId);
+    return mqttPacket(type << 4 | (type == MQTT_PACKET_PUBREL ? 0x02 : 0), body);
+}
+
+/**
+ * Whether a complete packet sits at the start of a receive buffer
+ *
+ * @param buffer is what was received so far
+ * @param total is set to the size of the first packet, fixed header included
+ * @return 1 when complete, 0 when more bytes are needed, -1 when the remaining length is malformed
+ */
+inline int mqttPacketComplete(const std::string &buffer, std::size_t &total)
+{
+    uint32_t length = 0;
+    for (std::size_t i = 1; i < 5; i++)
+    {
+        if (i >= buffer.size())
+            return 0;
+        length |= (uint32_t)(buffer[i] & 0x7f) << (7 * (i - 1));
+        if ((buffer[i] & 0x80) == 0)
+        {
+            total = i + 1 + length;
+            return buffer.size() >= total ? 1 : 0;
+        }
+    }
+    return -1;
+}
+
+// Bounds checked reader over the variable header and payload of a packet
+struct MqttReader
+{
+    const uint8_t *data;
+    std::size_t length;
+    std::size_t pos;
+    bool ok;
+
+    MqttReader(const std::string &packet, std::size_t offset)
+        : data(reinterpret_cast<const uint8_t *>(packet.data())), length(packet.size()), pos(offset), ok(offset <= packet.size()) {}
+
+    inline std::size_t remaining() const { return ok ? length - pos : 0; }
+
+    inline uint8_t u8()
+    {
+        if (remaining() < 1)
+            return ok = false;
+        return data[pos++];
+    }
+
+    inline uint16_t u16()
+    {
+        if (remaining() < 2)
+            return ok = false;
+        pos += 2;
+        return (uint16_t)(data[pos - 2] << 8 | data[pos - 1]);
+    }
+
+    inline uint32_t u32()
+    {
+        uint32_t high = u16();
+        return high << 16 | u16();
+    }
+
+    inline uint32_t varint()
+    {
+        uint32_t value = 0;
+        for (int shift = 0; shift < 28; shift += 7)
+        {
+            uint8_t byte = u8();
+            value |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    inline const char *string(std::size_t &size)
+    {
+        size = u16();
+        if (remaining() < size)
+        {
+            ok = false;
+            return "";
+        }
+        pos += size;
+        return reinterpret_cast<const char *>(data + pos - size);
+    }
+
+    inline void skip(std::size_t size)
+    {
+        if (remaining() < size)
+            ok = false;
+        else
+            pos += size;
+    }
+};
+
+// Offset of the variable header, after the fixed header of a complete packet
+inline std::size_t mqttHeaderSize(const std::string &packet)
+{
+    std::size_t i = 1;
+    while (i < packet.size() && i < 5 && (packet[i] & 0x80))
+        i++;
+    return i + 1;
+}
+
+inline bool mqttSendAll(int fd, const char *data, std::size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
@@ -0,0 +1,875 @@
+#include "mqtt_client.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "ESP32MQTTHostPacket.h"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const char *TAG = "mqtt_client";
+
+// esp-mqtt defaults
+static constexpr int DEFAULT_KEEPALIVE_S = 120;
+static constexpr int DEFAULT_RECONNECT_MS = 10000;
+static constexpr int DEFAULT_NETWORK_TIMEOUT_MS = 10000;
+static constexpr int DEFAULT_RETRANSMIT_MS = 1000;
+static constexpr int DEFAULT_BUFFER_SIZE = 1024;
+static constexpr int64_t OUTBOX_EXPIRED_TIMEOUT_US = 30000000;
+static constexpr int POLL_INTERVAL_MS = 10;
+
+static const char *MQTT_EVENTS = "MQTT_EVENTS";
+
+extern "C" int64_t esp_timer_get_time(void)
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+extern "C" void esp_restart(void)
+{
+    ESP_LOGE("system", "esp_restart() called, exiting");
+    exit(EXIT_FAILURE);
+}
+
+enum ClientState : uint8_t
+{
+    STATE_INIT,
+    STATE_CONNECTED,
+    STATE_WAIT_RECONNECT
+};
+
+// A QoS>0 publish, or a subscribe, waiting for its acknowledgement
+struct OutboxItem
+{
+    int msgId;
+    uint8_t type; // MQTT_PACKET_PUBLISH, _PUBREL once PUBREC arrived, _SUBSCRIBE or _UNSUBSCRIBE
+    std::string packet;
+    int64_t createdUs;
+    int64_t sentUs; // 0: not sent on the current connection yet
+};
+
+struct esp_mqtt_client
+{
+    std::recursive_mutex lock; // The esp-mqtt API lock, events are dispatched with it held
+    std::thread task;
+    std::atomic<bool> running;
+
+    // Configuration, copied as esp-mqtt does
+    std::string uri;
+    std::string host;
+    uint16_t port;
+    std::string clientId;
+    bool hasUsername;
+    std::string username;
+    bool hasPassword;
+    std::string password;
+    std::string willTopic;
+    std::string willMessage;
+    int willQos;
+    bool willRetain;
+    bool cleanSession;
+    int keepaliveS;
+    int reconnectMs;
+    int networkTimeoutMs;
+    int retransmitMs;
+    int bufferSize;
+    bool autoReconnect;
+    esp_mqtt_protocol_ver_t protocol;
+    uint32_t sessionExpiry;
+    uint16_t receiveMaximum;
+
+    esp_event_handler_t handler;
+    void *handlerArg;
+
+    ClientState state;
+    int sock;
+    int64_t reconnectAtUs;
+    bool disconnectRequested; // esp_mqtt_client_disconnect(), carried out by the task
+    bool userDisconnected;    // Since then no automatic reconnection
+    bool reconnectRequested;  // esp_mqtt_client_reconnect(), reconnects even without auto reconnection
+    int64_t lastSentUs;
+    int64_t pingSentUs;
+    uint16_t nextMsgId;
+    std::vector<OutboxItem> outbox;
+    std::string received;
+    esp_mqtt_error_codes_t error;
+};
+
+static void copyConfig(esp_mqtt_client *client, const esp_mqtt_client_config_t *config)
+{
+    if (config->broker.address.uri)
+        client->uri = config->broker.address.uri;
+    else if (config->broker.address.hostname)
+        client->uri = std::string("mqtt://") + config->broker.address.hostname + ":" + std::to_string(config->broker.address.port ? config->broker.address.port : 1883);
+
+    if (config->credentials.client_id)
+        client->clientId = config->credentials.client_id;
+    else if (!config->credentials.set_null_client_id)
+        client->clientId = "ESP32_HOST_" + std::to_string(getpid());
+    client->hasUsername = config->credentials.username != nullptr;
+    client->username = client->hasUsername ? config->credentials.username : "";
+    client->hasPassword = config->credentials.authentication.password != nullptr;
+    client->password = client->hasPassword ? config->credentials.authentication.password : "";
+
+    client->willTopic = config->session.last_will.topic ? config->session.last_will.topic : "";
+    if (config->session.last_will.msg)
+        client->willMessage.assign(config->session.last_will.msg, config->session.last_will.msg_len ? config->session.last_will.msg_len : strlen(config->session.last_will.msg));
+    client->willQos = config->session.last_will.qos;
+    client->willRetain = config->session.last_will.retain;
+    client->cleanSession = !config->session.disable_clean_session;
+    client->keepaliveS = config->session.disable_keepalive ? 0 : (config->session.keepalive ? config->session.keepalive : DEFAULT_KEEPALIVE_S);
+    client->protocol = config->session.protocol_ver == MQTT_PROTOCOL_V_5 ? MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1;
+    client->retransmitMs = config->session.message_retransmit_timeout ? config->session.message_retransmit_timeout : DEFAULT_RETRANSMIT_MS;
+    client->reconnectMs = config->network.reconnect_timeout_ms ? config->network.reconnect_timeout_ms : DEFAULT_RECONNECT_MS;
+    client->networkTimeoutMs = config->network.timeout_ms ? config->network.timeout_ms : DEFAULT_NETWORK_TIMEOUT_MS;
+    client->autoReconnect = !config->network.disable_auto_reconnect;
+    client->bufferSize = config->buffer.size ? config->buffer.size : DEFAULT_BUFFER_SIZE;
+}
+
+/**
+ * Split an mqtt:// URI into host and port
+ *
+ * @return false for any other scheme, the host transport has no TLS nor websockets
+ */
+static bool parseUri(esp_mqtt_client *client)
+{
+    const char *scheme = "mqtt://";
+    if (client->uri.compare(0, strlen(scheme), scheme) != 0)
+        return false;
+
+    std::string rest = client->uri.substr(strlen(scheme));
+    rest = rest.substr(0, rest.find('/'));
+    std::size_t colon = rest.rfind(':');
+    client->host = rest.substr(0, colon);
+    client->port = colon == std::string::npos ? 1883 : (uint16_t)atoi(rest.c_str() + colon + 1);
+    return !client->host.empty();
+}
+
+static void dispatch(esp_mqtt_client *client, esp_mqtt_event_t &event)
+{
+    event.client = client;
+    event.protocol_ver = client->protocol;
+    if (client->handler)
+        client->handler(client->handlerArg, MQTT_EVENTS, event.event_id, &event);
+}
+
+static void dispatchSimple(esp_mqtt_client *client, esp_mqtt_event_id_t id, int msgId)
+{
+    esp_mqtt_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_id = id;
+    event.msg_id = msgId;
+    event.error_handle = &client->error;
+    dispatch(client, event);
+}
+
+static void dispatchError(esp_mqtt_client *client, esp_mqtt_error_type_t type, int sockErrno, esp_mqtt_connect_return_code_t code)
+{
+    memset(&client->error, 0, sizeof(client->error));
+    client->error.error_type = type;
+    client->error.esp_transport_sock_errno = sockErrno;
+    client->error.connect_return_code = code;
+    dispatchSimple(client, MQTT_EVENT_ERROR, -1);
+}
+
+static bool sendPacket(esp_mqtt_client *client, const std::string &packet)
+{
+    if (client->sock < 0 || !mqttSendAll(client->sock, packet.data(), packet.size()))
+        return false;
+    client->lastSentUs = esp_timer_get_time();
+    return true;
+}
+
+static uint16_t nextMsgId(esp_mqtt_client *client)
+{
+    if (++client->nextMsgId == 0)
+        client->nextMsgId = 1;
+    return client->nextMsgId;
+}
+
+// Drop the connection, or the connection attempt, from the MQTT task: ERROR, DISCONNECTED, then wait reconnect_timeout_ms
+static void abortConnection(esp_mqtt_client *client, int sockErrno)
+{
+    if (client->sock >= 0)
+    {
+        close(client->sock);
+        client->sock = -1;
+    }
+    client->received.clear();
+    client->pingSentUs = 0;
+    client->disconnectRequested = false;
+    if (sockErrno >= 0)
+        dispatchError(client, MQTT_ERROR_TYPE_TCP_TRANSPORT, sockErrno, MQTT_CONNECTION_ACCEPTED);
+    // esp-mqtt reports every failed attempt as a disconnection too. The wait is set first, the handler may cut it short
+    client->state = STATE_WAIT_RECONNECT;
+    client->reconnectAtUs = esp_timer_get_time() + (int64_t)client->reconnectMs * 1000;
+    dispatchSimple(client, MQTT_EVENT_DISCONNECTED, -1);
+}
+
+static int connectSocket(esp_mqtt_client *client)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(client->host.c_str(), std::to_string(client->port).c_str(), &hints, &result) != 0 || result == nullptr)
+        return -EHOSTUNREACH;
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    int err = 0;
+    if (fd < 0)
+    {
+        err = errno;
+    }
+    else
+    {
+        // Non blocking connect bounded by the network timeout
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(fd, result->ai_addr, result->ai_addrlen) != 0 && errno != EINPROGRESS)
+            err = errno;
+        else
+        {
+            pollfd pfd = {fd, POLLOUT, 0};
+            socklen_t len = sizeof(err);
+            if (poll(&pfd, 1, client->networkTimeoutMs) != 1)
+                err = ETIMEDOUT;
+            else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+                err = errno;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    freeaddrinfo(result);
+
+    if (err != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -err;
+    }
+    return fd;
+}
+
+static std::string connectPacket(esp_mqtt_client *client)
+{
+    bool v5 = client->protocol == MQTT_PROTOCOL_V_5;
+    bool will = !client->willTopic.empty();
+    uint8_t flags = (client->cleanSession ? 0x02 : 0) | (will ? 0x04 | (client->willQos & 3) << 3 | (client->willRetain ? 0x20 : 0) : 0) |
+                    (client->hasPassword ? 0x40 : 0) | (client->hasUsername ? 0x80 : 0);
+
+    std::string body;
+    mqttPutString(body, "MQTT", 4);
+    body += (char)(v5 ? MQTT_PROTOCOL_LEVEL_5 : MQTT_PROTOCOL_LEVEL_311);
+    body += (char)flags;
+    mqttPut16(body, client->keepaliveS);
+    if (v5)
+    {
+        std::string properties;
+        if (client->sessionExpiry)
+        {
+            properties += (char)0x11;
+            mqttPut16(properties, client->sessionExpiry >> 16);
+            mqttPut16(properties, client->sessionExpiry);
+        }
+        if (client->receiveMaximum)
+        {
+            properties += (char)0x21;
+            mqttPut16(properties, client->receiveMaximum);
+        }
+        mqttPutVarint(body, properties.size());
+        body += properties;
+    }
+
+    mqttPutString(body, client->clientId.data(), client->clientId.size());
+    if (will)
+    {
+        if (v5)
+            mqttPutVarint(body, 0);
+        mqttPutString(body, client->willTopic.data(), client->willTopic.size());
+        mqttPutString(body, client->willMessage.data(), client->willMessage.size());
+    }
+    if (client->hasUsername)
+        mqttPutString(body, client->username.data(), client->username.size());
+    if (client->hasPassword)
+        mqttPutString(body, client->password.data(), client->password.size());
+
+    return mqttPacket(MQTT_PACKET_CONNECT << 4, body);
+}
+
+static esp_mqtt_connect_return_code_t connackReturnCode(uint8_t code, bool v5)
+{
+    if (!v5 || code == 0)
+        return (esp_mqtt_connect_return_code_t)code;
+
+    // MQTT 5 reason codes back to their MQTT 3.1.1 equivalent, like esp-mqtt reports them
+    switch (code)
+    {
+    case 0x84:
+        return MQTT_CONNECTION_REFUSE_PROTOCOL;
+    case 0x85:
+        return MQTT_CONNECTION_REFUSE_ID_REJECTED;
+    case 0x86:
+        return MQTT_CONNECTION_REFUSE_BAD_USERNAME;
+    case 0x87:
+        return MQTT_CONNECTION_REFUSE_NOT_AUTHORIZED;
+    default:
+        return MQTT_CONNECTION_REFUSE_SERVER_UNAVAILABLE;
+    }
+}
+
+/**
+ * Read one packet with a deadline, only used while waiting for CONNACK
+ *
+ * @return the packet, empty on timeout or a closed connection
+ */
+static std::string readPacket(esp_mqtt_client *client, int64_t deadlineUs)
+{
+    std::size_t total;
+    char chunk[256];
+    while (mqttPacketComplete(client->received, total) != 1)
+    {
+        int64_t left = deadlineUs - esp_timer_get_time();
+        pollfd pfd = {client->sock, POLLIN, 0};
+        if (left <= 0 || poll(&pfd, 1, (int)(left / 1000) + 1) != 1)
+            return std::string();
+        ssize_t got = recv(client->sock, chunk, sizeof(chunk), 0);
+        if (got <= 0)
+            return std::string();
+        client->received.append(chunk, got);
+    }
+
+    std::string packet = client->received.substr(0, total);
+    client->received.erase(0, total);
+    return packet;
+}
+
+static void connectBroker(esp_mqtt_client *client)
+{
+    dispatchSimple(client, MQTT_EVENT_BEFORE_CONNECT, -1);
+    if (!parseUri(client))
+    {
+        ESP_LOGE(TAG, "Unsupported URI %s, the host transport only speaks mqtt://", client->uri.c_str());
+        abortConnection(client, EPROTONOSUPPORT);
+        return;
+    }
+
+    int fd = connectSocket(client);
+    if (fd < 0)
+    {
+        ESP_LOGE(TAG, "Error transport connect (%s:%u): %s", client->host.c_str(), client->port, strerror(-fd));
+        abortConnection(client, -fd);
+        return;
+    }
+    client->sock = fd;
+    client->received.clear();
+
+    std::string connack;
+    if (sendPacket(client, connectPacket(client)))
+        connack = readPacket(client, esp_timer_get_time() + (int64_t)client->networkTimeoutMs * 1000);
+    if (connack.empty() || (uint8_t)connack[0] >> 4 != MQTT_PACKET_CONNACK)
+    {
+        ESP_LOGE(TAG, "No CONNACK from the broker");
+        abortConnection(client, ECONNABORTED);
+        return;
+    }
+
+    MqttReader reader(connack, mqttHeaderSize(connack));
+    bool sessionPresent = reader.u8() & 0x01;
+    uint8_t code = reader.u8();
+    if (!reader.ok || code != 0)
+    {
+        close(client->sock);
+        client->sock = -1;
+        dispatchError(client, MQTT_ERROR_TYPE_CONNECTION_REFUSED, 0, connackReturnCode(code, client->protocol == MQTT_PROTOCOL_V_5));
+        abortConnection(client, -1);
+        return;
+    }
+
+    client->state = STATE_CONNECTED;
+    client->pingSentUs = 0;
+    for (std::size_t i = 0; i < client->outbox.size(); i++)
+        client->outbox[i].sentUs = 0; // Sent again below, after the CONNECTED event as esp-mqtt does
+
+    esp_mqtt_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_id = MQTT_EVENT_CONNECTED;
+    event.session_present = sessionPresent;
+    event.error_handle = &client->error;
+    dispatch(client, event);
+}
+
+static void dispatchData(esp_mqtt_client *client, const std::string &packet)
+{
+    uint8_t header = packet[0];
+    int qos = (header >> 1) & 3;
+    MqttReader reader(packet, mqttHeaderSize(packet));
+    std::size_t topicLen;
+    const char *topic = reader.string(topicLen);
+    int msgId = qos ? reader.u16() : 0;
+    if (client->protocol == MQTT_PROTOCOL_V_5)
+        reader.skip(reader.varint());
+    if (!reader.ok)
+        return;
+
+    if (qos == 1)
+        sendPacket(client, mqttAckPacket(MQTT_PACKET_PUBACK, msgId));
+    else if (qos == 2)
+        sendPacket(client, mqttAckPacket(MQTT_PACKET_PUBREC, msgId));
+
+    // Payloads larger than the receive buffer come in several DATA events, the topic only in the first
+    const char *payload = reinterpret_cast<const char *>(reader.data + reader.pos);
+    int total = reader.remaining();
+    int offset = 0;
+    do
+    {
+        int chunk = total - offset;
+        int room = offset ? client->bufferSize : client->bufferSize - (int)topicLen;
+        if (room < 1)
+            room = 1;
+        if (chunk > room)
+            chunk = room;
+
+        esp_mqtt_event_t event;
+        memset(&event, 0, sizeof(event));
+        event.event_id = MQTT_EVENT_DATA;
+        event.topic = offset ? nullptr : const_cast<char *>(topic);
+        event.topic_len = offset ? 0 : topicLen;
+        event.data = const_cast<char *>(payload + offset);
+        event.data_len = chunk;
+        event.total_data_len = total;
+        event.current_data_offset = offset;
+        event.msg_id = msgId;
+        event.qos = qos;
+        event.retain = header & 0x01;
+        event.dup = header & 0x08;
+        event.error_handle = &client->error;
+        dispatch(client, event);
+        offset += chunk;
+    } while (offset < total);
+}
+
+static void ackOutbox(esp_mqtt_client *client, uint8_t type, uint16_t msgId)
+{
+    for (std::size_t i = 0; i < client->outbox.size(); i++)
+    {
+        OutboxItem &item = client->outbox[i];
+        if (item.msgId != msgId)
+            continue;
+
+        if (type == MQTT_PACKET_PUBREC && item.type == MQTT_PACKET_PUBLISH)
+        {
+            item.type = MQTT_PACKET_PUBREL;
+            item.packet = mqttAckPacket(MQTT_PACKET_PUBREL, msgId);
+            item.sentUs = esp_timer_get_time();
+            sendPacket(client, item.packet);
+            return;
+        }
+
+        esp_mqtt_event_id_t event;
+        if (type == MQTT_PACKET_PUBACK && item.type == MQTT_PACKET_PUBLISH)
+            event = MQTT_EVENT_PUBLISHED;
+        else if (type == MQTT_PACKET_PUBCOMP && item.type == MQTT_PACKET_PUBREL)
+            event = MQTT_EVENT_PUBLISHED;
+        else if (type == MQTT_PACKET_SUBACK && item.type == MQTT_PACKET_SUBSCRIBE)
+            event = MQTT_EVENT_SUBSCRIBED;
+        else if (type == MQTT_PACKET_UNSUBACK && item.type == MQTT_PACKET_UNSUBSCRIBE)
+            event = MQTT_EVENT_UNSUBSCRIBED;
+        else
+            continue;
+
+        client->outbox.erase(client->outbox.begin() + i);
+        dispatchSimple(client, event, msgId);
+        return;
+    }
+}
+
+static void processPacket(esp_mqtt_client *client, const std::string &packet)
+{
+    uint8_t type = (uint8_t)packet[0] >> 4;
+    MqttReader reader(packet, mqttHeaderSize(packet));
+    switch (type)
+    {
+    case MQTT_PACKET_PUBLISH:
+        dispatchData(client, packet);
+        break;
+    case MQTT_PACKET_PUBREL:
+        sendPacket(client, mqttAckPacket(MQTT_PACKET_PUBCOMP, reader.u16()));
+        break;
+    case MQTT_PACKET_PUBACK:
+    case MQTT_PACKET_PUBREC:
+    case MQTT_PACKET_PUBCOMP:
+    case MQTT_PACKET_SUBACK:
+    case MQTT_PACKET_UNSUBACK:
+    {
+        uint16_t msgId = reader.u16();
+        if (reader.ok)
+            ackOutbox(client, type, msgId);
+        break;
+    }
+    case MQTT_PACKET_PINGRESP:
+        client->pingSentUs = 0;
+        break;
+    case MQTT_PACKET_DISCONNECT: // MQTT 5 server disconnect
+        abortConnection(client, ECONNRESET);
+        break;
+    default:
+        break;
+    }
+}
+
+// Keepalive, retransmissions and outbox expiry, called by the MQTT task while connected
+static void connectedTick(esp_mqtt_client *client)
+{
+    int64_t now = esp_timer_get_time();
+    if (client->keepaliveS > 0)
+    {
+        if (client->pingSentUs && now - client->pingSentUs > (int64_t)client->networkTimeoutMs * 1000)
+        {
+            ESP_LOGE(TAG, "No PING_RESP, disconnected");
+            abortConnection(client, ETIMEDOUT);
+            return;
+        }
+        if (!client->pingSentUs && now - client->lastSentUs >= (int64_t)client->keepaliveS * 1000000)
+        {
+            client->pingSentUs = now;
+            sendPacket(client, mqttPacket(MQTT_PACKET_PINGREQ << 4, std::string()));
+        }
+    }
+
+    for (std::size_t i = 0; i < client->outbox.size(); i++)
+    {
+        OutboxItem &item = client->outbox[i];
+        if (now - item.createdUs > OUTBOX_EXPIRED_TIMEOUT_US)
+        {
+            int msgId = item.msgId;
+            client->outbox.erase(client->outbox.begin() + i);
+            i--;
+            dispatchSimple(client, MQTT_EVENT_DELETED, msgId);
+        }
+        else if (item.sentUs == 0 || now - item.sentUs > (int64_t)client->retransmitMs * 1000)
+        {
+            if (item.sentUs != 0 && item.type == MQTT_PACKET_PUBLISH)
+                item.packet[0] |= 0x08; // DUP
+            item.sentUs = now;
+            if (!sendPacket(client, item.packet))
+            {
+                abortConnection(client, errno);
+                return;
+            }
+        }
+    }
+}
+
+static void mqttTask(esp_mqtt_client *client)
+{
+    char chunk[1024];
+    while (client->running)
+    {
+        int sock = -1;
+        {
+            std::lock_guard<std::recursive_mutex> lock(client->lock);
+            if (client->state == STATE_INIT ||
+                (client->state == STATE_WAIT_RECONNECT && ((client->autoReconnect && !client->userDisconnected) || client->reconnectRequested) &&
+                 esp_timer_get_time() >= client->reconnectAtUs))
+            {
+                client->reconnectRequested = false;
+                client->userDisconnected = false;
+                connectBroker(client);
+            }
+            if (client->state == STATE_CONNECTED && client->disconnectRequested)
+            {
+                // Graceful: DISCONNECT, so no will, and no automatic reconnection until esp_mqtt_client_reconnect()
+                sendPacket(client, mqttPacket(MQTT_PACKET_DISCONNECT << 4, std::string()));
+                client->userDisconnected = true;
+                abortConnection(client, -1);
+            }
+            if (client->state == STATE_CONNECTED)
+                connectedTick(client);
+            if (client->state == STATE_CONNECTED)
+                sock = client->sock;
+        }
+
+        if (sock < 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_INTERVAL_MS));
+            continue;
+        }
+
+        // Wait for data without the lock, API calls may publish meanwhile
+        pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, POLL_INTERVAL_MS) != 1)
+            continue;
+        ssize_t got = recv(sock, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (got < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        int err = got < 0 ? errno : ECONNRESET;
+
+        std::lock_guard<std::recursive_mutex> lock(client->lock);
+        if (client->sock != sock || !client->running)
+            continue; // Disconnected or stopped by an API call meanwhile
+        if (got <= 0)
+        {
+            ESP_LOGE(TAG, "Connection closed by the broker (%s)", strerror(err));
+            abortConnection(client, err);
+            continue;
+        }
+
+        client->received.append(chunk, got);
+        std::size_t total;
+        int complete;
+        while (client->sock == sock && (complete = mqttPacketComplete(client->received, total)) == 1)
+        {
+            std::string packet = client->received.substr(0, total);
+            client->received.erase(0, total);
+            processPacket(client, packet);
+        }
+        if (client->sock == sock && complete < 0)
+            abortConnection(client, EPROTO);
+    }
+}
+
+static int enqueue(esp_mqtt_client *client, uint8_t type, uint16_t msgId, const std::string &packet)
+{
+    int64_t now = esp_timer_get_time();
+    client->outbox.push_back({msgId, type, packet, now, 0});
+    if (client->state == STATE_CONNECTED)
+    {
+        client->outbox.back().sentUs = now;
+        sendPacket(client, packet);
+    }
+    return msgId;
+}
+
+extern "C" esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    esp_mqtt_client *client = new esp_mqtt_client();
+    client->running = false;
+    client->port = 1883;
+    client->willQos = 0;
+    client->willRetain = false;
+    client->sessionExpiry = 0;
+    client->receiveMaximum = 0;
+    client->handler = nullptr;
+    client->handlerArg = nullptr;
+    client->state = STATE_INIT;
+    client->sock = -1;
+    client->reconnectAtUs = 0;
+    client->disconnectRequested = false;
+    client->userDisconnected = false;
+    client->reconnectRequested = false;
+    client->lastSentUs = 0;
+    client->pingSentUs = 0;
+    client->nextMsgId = 0;
+    memset(&client->error, 0, sizeof(client->error));
+    copyConfig(client, config);
+    return client;
+}
+
+extern "C" esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_client_config_t *config)
+{
+    if (client == nullptr || config == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    copyConfig(client, config);
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *uri)
+{
+    if (client == nullptr || uri == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    client->uri = uri;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t event_handler, void *event_handler_arg)
+{
+    if (client == nullptr || event != MQTT_EVENT_ANY)
+        return ESP_ERR_INVALID_ARG; // Only the catch-all registration the client library uses
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    client->handler = event_handler;
+    client->handlerArg = event_handler_arg;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt5_client_set_connect_property(esp_mqtt_client_handle_t client, const esp_mqtt5_connection_property_config_t *connect_property)
+{
+    if (client == nullptr || connect_property == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    client->sessionExpiry = connect_property->session_expiry_interval;
+    client->receiveMaximum = connect_property->receive_maximum;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    if (client == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    if (client->running)
+        return ESP_FAIL;
+
+    client->state = STATE_INIT;
+    client->disconnectRequested = false;
+    client->userDisconnected = false;
+    client->reconnectRequested = false;
+    client->running = true;
+    client->task = std::thread(mqttTask, client);
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client)
+{
+    if (client == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    if (client->state != STATE_WAIT_RECONNECT)
+        return ESP_FAIL;
+
+    client->reconnectRequested = true;
+    client->reconnectAtUs = 0;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client)
+{
+    if (client == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    if (client->state != STATE_CONNECTED)
+        return ESP_FAIL;
+
+    // As esp-mqtt: only flagged here, the task disconnects and dispatches MQTT_EVENT_DISCONNECTED. Until then the
+    // client is still connected, esp_mqtt_client_reconnect() is refused
+    client->disconnectRequested = true;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+    if (client == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    if (!client->running || std::this_thread::get_id() == client->task.get_id())
+        return ESP_FAIL;
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(client->lock);
+        if (client->state == STATE_CONNECTED)
+            sendPacket(client, mqttPacket(MQTT_PACKET_DISCONNECT << 4, std::string()));
+        client->running = false;
+    }
+    client->task.join();
+
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    bool connected = client->state == STATE_CONNECTED;
+    if (client->sock >= 0)
+        close(client->sock);
+    client->sock = -1;
+    client->state = STATE_INIT;
+    if (connected)
+        dispatchSimple(client, MQTT_EVENT_DISCONNECTED, -1);
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
+{
+    if (client == nullptr)
+        return ESP_ERR_INVALID_ARG;
+    esp_mqtt_client_stop(client);
+    delete client;
+    return ESP_OK;
+}
+
+extern "C" int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+    if (client == nullptr || topic == nullptr)
+        return -1;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    if (client->state != STATE_CONNECTED)
+        return -1;
+
+    uint16_t msgId = nextMsgId(client);
+    std::string body;
+    mqttPut16(body, msgId);
+    if (client->protocol == MQTT_PROTOCOL_V_5)
+        mqttPutVarint(body, 0);
+    mqttPutString(body, topic, strlen(topic));
+    body += (char)(qos & 3);
+    return enqueue(client, MQTT_PACKET_SUBSCRIBE, msgId, mqttPacket(MQTT_PACKET_SUBSCRIBE << 4 | 0x02, body));
+}
+
+extern "C" int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *topic)
+{
+    if (client == nullptr || topic == nullptr)
+        return -1;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    if (client->state != STATE_CONNECTED)
+        return -1;
+
+    uint16_t msgId = nextMsgId(client);
+    std::string body;
+    mqttPut16(body, msgId);
+    if (client->protocol == MQTT_PROTOCOL_V_5)
+        mqttPutVarint(body, 0);
+    mqttPutString(body, topic, strlen(topic));
+    return enqueue(client, MQTT_PACKET_UNSUBSCRIBE, msgId, mqttPacket(MQTT_PACKET_UNSUBSCRIBE << 4 | 0x02, body));
+}
+
+extern "C" int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain, bool /* store */)
+{
+    if (client == nullptr || topic == nullptr)
+        return -1;
+    if (data != nullptr && len <= 0)
+        len = strlen(data);
+
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    // QoS 0 is only sent while connected, QoS>0 waits in the outbox
+    if (qos == 0 && client->state != STATE_CONNECTED)
+        return -1;
+
+    uint16_t msgId = qos ? nextMsgId(client) : 0;
+    std::string body;
+    mqttPutString(body, topic, strlen(topic));
+    if (qos)
+        mqttPut16(body, msgId);
+    if (client->protocol == MQTT_PROTOCOL_V_5)
+        mqttPutVarint(body, 0);
+    if (data != nullptr)
+        body.append(data, len);
+    std::string packet = mqttPacket(MQTT_PACKET_PUBLISH << 4 | (qos & 3) << 1 | (retain ? 1 : 0), body);
+
+    if (qos == 0)
+        return sendPacket(client, packet) ? 0 : -1;
+    return enqueue(client, MQTT_PACKET_PUBLISH, msgId, packet);
+}
+
+extern "C" int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    return esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true);
+}
+
+extern "C" int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client)
+{
+    if (client == nullptr)
+        return 0;
+    std::lock_guard<std::recursive_mutex> lock(client->lock);
+    int size = 0;
+    for (std::size_t i = 0; i < client->outbox.size(); i++)
+        size += client->outbox[i].packet.size();
+    return size;
+}
@@ -0,0 +1,741 @@
+#include "ESP32MQTTLoopbackBroker.h"
+#include "ESP32MQTTStaticRoutes.h"
+#include "esp_log.h"
+#include <chrono>
+#include <sstream>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+static const char *TAG = "loopback_broker";
+
+static const char *const PACKET_NAMES[] = {"ANY", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+                                           "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT"};
+
+// MQTT 3.1.1 CONNACK return codes to MQTT 5 reason codes
+static uint8_t connackReasonCode(uint8_t returnCode)
+{
+    static const uint8_t reasons[] = {0x00, 0x84, 0x85, 0x88, 0x86, 0x87};
+    return returnCode < sizeof(reasons) ? reasons[returnCode] : 0x80;
+}
+
+ESP32MQTTLoopbackBroker::ESP32MQTTLoopbackBroker()
+    : _listenFd(-1), _port(0), _running(false), _refuseCode(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+ESP32MQTTLoopbackBroker::~ESP32MQTTLoopbackBroker()
+{
+    stop();
+}
+
+bool ESP32MQTTLoopbackBroker::start(uint16_t port)
+{
+    if (_running)
+        return false;
+
+    _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port ? port : _port);
+    socklen_t length = sizeof(address);
+    if (bind(_listenFd, (sockaddr *)&address, length) != 0 || listen(_listenFd, 8) != 0 ||
+        getsockname(_listenFd, (sockaddr *)&address, &length) != 0)
+    {
+        ESP_LOGE(TAG, "Cannot listen on port %u: %s", port, strerror(errno));
+        close(_listenFd);
+        _listenFd = -1;
+        return false;
+    }
+
+    _port = ntohs(address.sin_port);
+    _running = true;
+    _acceptTask = std::thread(&ESP32MQTTLoopbackBroker::acceptTaskLoop, this);
+    ESP_LOGI(TAG, "Listening on %s", uri().c_str());
+    return true;
+}
+
+void ESP32MQTTLoopbackBroker::stop()
+{
+    if (!_running)
+        return;
+
+    _running = false;
+    shutdown(_listenFd, SHUT_RDWR);
+    _acceptTask.join();
+    close(_listenFd);
+    _listenFd = -1;
+
+    disconnectClients();
+    std::vector<std::shared_ptr<Connection>> connections;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        connections.swap(_connections);
+    }
+    for (std::size_t i = 0; i < connections.size(); i++)
+        connections[i]->thread.join();
+}
+
+std::string ESP32MQTTLoopbackBroker::uri() const
+{
+    return "mqtt://127.0.0.1:" + std::to_string(_port);
+}
+
+void ESP32MQTTLoopbackBroker::addFault(FaultDirection direction, uint8_t packetType, uint32_t occurrence, FaultAction action, uint32_t delayMs, uint32_t bytes)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults.push_back({direction, packetType, occurrence, action, delayMs, bytes, 0});
+}
+
+bool ESP32MQTTLoopbackBroker::addFaults(const char *script)
+{
+    std::stringstream statements(script);
+    std::string statement;
+    while (std::getline(statements, statement, ';'))
+    {
+        std::stringstream words(statement);
+        std::string direction, packet, action;
+        if (!(words >> direction))
+            continue; // Empty statement
+        words >> packet >> action;
+
+        uint32_t occurrence = 0;
+        std::size_t hash = packet.find('#');
+        if (hash != std::string::npos)
+        {
+            occurrence = strtoul(packet.c_str() + hash + 1, nullptr, 10);
+            packet.resize(hash);
+        }
+
+        uint8_t type = 0;
+        while (type < sizeof(PACKET_NAMES) / sizeof(PACKET_NAMES[0]) && packet != PACKET_NAMES[type])
+            type++;
+
+        uint32_t first = 0, second = 0;
+        FaultAction faultAction;
+        if (action == "delay" && (words >> first))
+            faultAction = FAULT_DELAY;
+        else if (action == "drop")
+            faultAction = FAULT_DROP;
+        else if (action == "disconnect")
+            faultAction = FAULT_DISCONNECT;
+        else if (action == "partial" && (words >> first >> second))
+            faultAction = FAULT_PARTIAL;
+        else
+            type = 0xff;
+
+        if ((direction != "in" && direction != "out") || type >= sizeof(PACKET_NAMES) / sizeof(PACKET_NAMES[0]))
+        {
+            ESP_LOGE(TAG, "Bad fault statement \"%s\"", statement.c_str());
+            return false;
+        }
+
+        if (faultAction == FAULT_PARTIAL)
+            addFault(direction == "in" ? FAULT_IN : FAULT_OUT, type, occurrence, faultAction, second, first);
+        else
+            addFault(direction == "in" ? FAULT_IN : FAULT_OUT, type, occurrence, faultAction, first);
+    }
+    return true;
+}
+
+void ESP32MQTTLoopbackBroker::clearFaults()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults.clear();
+}
+
+void ESP32MQTTLoopbackBroker::setRefuseConnections(uint8_t returnCode)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _refuseCode = returnCode;
+}
+
+void ESP32MQTTLoopbackBroker::disconnectClients()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (std::size_t i = 0; i < _connections.size(); i++)
+    {
+        std::lock_guard<std::mutex> writeLock(_connections[i]->writeMutex);
+        if (!_connections[i]->closed)
+            shutdown(_connections[i]->fd, SHUT_RDWR);
+    }
+}
+
+void ESP32MQTTLoopbackBroker::publish(const std::string &topic, const std::string &payload, uint8_t qos, bool retain)
+{
+    route({topic, payload, qos, retain});
+}
+
+std::size_t ESP32MQTTLoopbackBroker::clientCount()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::size_t count = 0;
+    for (std::map<std::string, std::shared_ptr<Session>>::iterator it = _sessions.begin(); it != _sessions.end(); ++it)
+        count += it->second->connection != nullptr;
+    return count;
+}
+
+ESP32MQTTLoopbackBroker::Stats ESP32MQTTLoopbackBroker::getStats()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+void ESP32MQTTLoopbackBroker::acceptTaskLoop()
+{
+    while (_running)
+    {
+        int fd = accept(_listenFd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // Listening socket shut down by stop()
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+        connection->fd = fd;
+        connection->version = 0;
+        connection->closed = false;
+        connection->graceful = false;
+        connection->hasWill = false;
+
+        // Reap the connections that ended since the last one
+        std::vector<std::shared_ptr<Connection>> ended;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (std::size_t i = 0; i < _connections.size(); i++)
+            {
+                if (_connections[i]->closed)
+                {
+                    ended.push_back(_connections[i]);
+                    _connections.erase(_connections.begin() + i);
+                    i--;
+                }
+            }
+            _connections.push_back(connection);
+            _stats.connections++;
+            connection->thread = std::thread(&ESP32MQTTLoopbackBroker::connectionTaskLoop, this, connection);
+        }
+        for (std::size_t i = 0; i < ended.size(); i++)
+            ended[i]->thread.join();
+    }
+}
+
+void ESP32MQTTLoopbackBroker::connectionTaskLoop(std::shared_ptr<Connection> connection)
+{
+    std::string received;
+    char chunk[1024];
+    bool open = true;
+    while (open)
+    {
+        ssize_t got = recv(connection->fd, chunk, sizeof(chunk), 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        received.append(chunk, got);
+
+        std::size_t total;
+        int complete;
+        while (open && (complete = mqttPacketComplete(received, total)) == 1)
+        {
+            std::string packet = received.substr(0, total);
+            received.erase(0, total);
+
+            Fault fault;
+            if (packetFault(FAULT_IN, (uint8_t)packet[0] >> 4, fault))
+            {
+                if (fault.action == FAULT_DROP)
+                    continue;
+                if (fault.action == FAULT_DISCONNECT)
+                {
+                    open = false;
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(fault.delayMs));
+            }
+            open = handlePacket(connection, packet);
+        }
+        if (complete < 0)
+            open = false;
+    }
+
+    closeConnection(connection);
+}
+
+/**
+ * Count a packet and find the scripted fault it triggers, if any
+ *
+ * @param direction is FAULT_OUT for a packet about to be sent, FAULT_IN for a received one
+ * @param packetType is the MqttPacketType of the packet
+ * @param fault is set to the fault to apply
+ * @return true if a fault fires on this packet
+ */
+bool ESP32MQTTLoopbackBroker::packetFault(FaultDirection direction, uint8_t packetType, Fault &fault)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (direction == FAULT_IN)
+    {
+        _stats.packetsIn++;
+        _stats.publishesIn += packetType == MQTT_PACKET_PUBLISH;
+    }
+    else
+    {
+        _stats.packetsOut++;
+        _stats.publishesOut += packetType == MQTT_PACKET_PUBLISH;
+    }
+
+    bool fired = false;
+    for (std::size_t i = 0; i < _faults.size(); i++)
+    {
+        Fault &candidate = _faults[i];
+        if (candidate.direction != direction || (candidate.packetType != 0 && candidate.packetType != packetType))
+            continue;
+
+        candidate.seen++;
+        if (!fired && (candidate.occurrence == 0 || candidate.seen == candidate.occurrence))
+        {
+            fault = candidate;
+            fired = true;
+            _stats.faultsFired++;
+            ESP_LOGW(TAG, "Fault: %s %s #%u", direction == FAULT_IN ? "in" : "out", PACKET_NAMES[packetType], candidate.seen);
+            if (candidate.occurrence != 0)
+            {
+                _faults.erase(_faults.begin() + i);
+                i--;
+            }
+        }
+    }
+    return fired;
+}
+
+void ESP32MQTTLoopbackBroker::send(const std::shared_ptr<Connection> &connection, const std::string &packet)
+{
+    Fault fault;
+    bool faulty = packetFault(FAULT_OUT, (uint8_t)packet[0] >> 4, fault);
+
+    // Holding the write lock across a delay keeps the packets of the connection in order
+    std::lock_guard<std::mutex> lock(connection->writeMutex);
+    if (connection->closed)
+        return;
+
+    if (!faulty)
+    {
+        mqttSendAll(connection->fd, packet.data(), packet.size());
+        return;
+    }
+
+    switch (fault.action)
+    {
+    case FAULT_DELAY:
+        std::this_thread::sleep_for(std::chrono::milliseconds(fault.delayMs));
+        mqttSendAll(connection->fd, packet.data(), packet.size());
+        break;
+    case FAULT_DROP:
+        break;
+    case FAULT_DISCONNECT:
+        shutdown(connection->fd, SHUT_RDWR);
+        break;
+    case FAULT_PARTIAL:
+    {
+        std::size_t first = fault.bytes < packet.size() ? fault.bytes : packet.size();
+        mqttSendAll(connection->fd, packet.data(), first);
+        std::this_thread::sleep_for(std::chrono::milliseconds(fault.delayMs));
+        mqttSendAll(connection->fd, packet.data() + first, packet.size() - first);
+        break;
+    }
+    }
+}
+
+void ESP32MQTTLoopbackBroker::closeConnection(const std::shared_ptr<Connection> &connection)
+{
+    bool publishWill = false;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::shared_ptr<Session> session = connection->session;
+        if (session && session->connection == connection)
+        {
+            session->connection.reset();
+            if (session->clean)
+                _sessions.erase(session->clientId);
+        }
+        connection->session.reset();
+        publishWill = connection->hasWill && !connection->graceful;
+    }
+
+    if (publishWill)
+        route(connection->will);
+
+    std::lock_guard<std::mutex> lock(connection->writeMutex);
+    close(connection->fd);
+    connection->closed = true;
+}
+
+bool ESP32MQTTLoopbackBroker::handlePacket(const std::shared_ptr<Connection> &connection, const std::string &packet)
+{
+    uint8_t header = packet[0];
+    uint8_t type = header >> 4;
+    MqttReader reader(packet, mqttHeaderSize(packet));
+
+    // Nothing but CONNECT before the session exists, nothing but CONNECT once more
+    if ((type == MQTT_PACKET_CONNECT) == (connection->version != 0))
+        return false;
+
+    switch (type)
+    {
+    case MQTT_PACKET_CONNECT:
+        return handleConnect(connection, reader);
+    case MQTT_PACKET_PUBLISH:
+        return handlePublish(connection, header, reader);
+    case MQTT_PACKET_SUBSCRIBE:
+        return handleSubscribe(connection, reader, true);
+    case MQTT_PACKET_UNSUBSCRIBE:
+        return handleSubscribe(connection, reader, false);
+    case MQTT_PACKET_PUBACK:
+    case MQTT_PACKET_PUBREC:
+    case MQTT_PACKET_PUBCOMP:
+    {
+        uint16_t id = reader.u16();
+        std::string pubrel;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::map<uint16_t, std::pair<uint8_t, Message>> &inflight = connection->session->inflight;
+            std::map<uint16_t, std::pair<uint8_t, Message>>::iterator it = inflight.find(id);
+            if (it == inflight.end())
+                break;
+            if (type == MQTT_PACKET_PUBREC && it->second.first == MQTT_PACKET_PUBLISH)
+            {
+                it->second.first = MQTT_PACKET_PUBREL;
+                pubrel = mqttAckPacket(MQTT_PACKET_PUBREL, id);
+            }
+            else if ((type == MQTT_PACKET_PUBACK && it->second.first == MQTT_PACKET_PUBLISH) ||
+                     (type == MQTT_PACKET_PUBCOMP && it->second.first == MQTT_PACKET_PUBREL))
+            {
+                inflight.erase(it);
+            }
+        }
+        if (!pubrel.empty())
+            send(connection, pubrel);
+        break;
+    }
+    case MQTT_PACKET_PUBREL:
+    {
+        uint16_t id = reader.u16();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::vector<uint16_t> &received = connection->session->receivedQos2;
+            for (std::size_t i = 0; i < received.size(); i++)
+            {
+                if (received[i] == id)
+                {
+                    received.erase(received.begin() + i);
+                    break;
+                }
+            }
+        }
+        send(connection, mqttAckPacket(MQTT_PACKET_PUBCOMP, id));
+        break;
+    }
+    case MQTT_PACKET_PINGREQ:
+        send(connection, mqttPacket(MQTT_PACKET_PINGRESP << 4, std::string()));
+        break;
+    case MQTT_PACKET_DISCONNECT:
+        connection->graceful = true;
+        return false;
+    default:
+        return false;
+    }
+
+    return reader.ok;
+}
+
+bool ESP32MQTTLoopbackBroker::handleConnect(const std::shared_ptr<Connection> &connection, MqttReader &reader)
+{
+    std::size_t length;
+    reader.string(length);
+    uint8_t level = reader.u8();
+    uint8_t flags = reader.u8();
+    reader.u16(); // Keepalive, not enforced
+    if (level == MQTT_PROTOCOL_LEVEL_5)
+        reader.skip(reader.varint());
+
+    const char *id = reader.string(length);
+    std::string clientId(id, length);
+    if (flags & 0x04)
+    {
+        if (level == MQTT_PROTOCOL_LEVEL_5)
+            reader.skip(reader.varint());
+        const char *topic = reader.string(length);
+        connection->will.topic.assign(topic, length);
+        const char *payload = reader.string(length);
+        connection->will.payload.assign(payload, length);
+        connection->will.qos = (flags >> 3) & 3;
+        connection->will.retain = flags & 0x20;
+        connection->hasWill = true;
+    }
+    if (flags & 0x80)
+        reader.string(length);
+    if (flags & 0x40)
+        reader.string(length);
+    if (!reader.ok)
+        return false;
+
+    bool clean = flags & 0x02;
+    uint8_t returnCode;
+    bool sessionPresent = false;
+    std::vector<std::string> resend;
+    std::shared_ptr<Connection> takenOver;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        returnCode = level != MQTT_PROTOCOL_LEVEL_311 && level != MQTT_PROTOCOL_LEVEL_5 ? 1 : _refuseCode;
+        if (returnCode == 0)
+        {
+            if (clientId.empty())
+                clientId = "loopback-" + std::to_string(_stats.connections);
+
+            std::shared_ptr<Session> &session = _sessions[clientId];
+            if (session && session->connection)
+            {
+                takenOver = session->connection;
+                takenOver->graceful = true; // Taken over, not lost: no will
+                session->connection.reset();
+            }
+            if (session && !clean)
+            {
+                sessionPresent = true;
+            }
+            else
+            {
+                session = std::make_shared<Session>();
+                session->clientId = clientId;
+                session->nextId = 0;
+            }
+            session->clean = clean;
+            session->connection = connection;
+            connection->session = session;
+            connection->version = level;
+
+            // Unacknowledged messages of a resumed session go out again, marked as duplicates
+            for (std::map<uint16_t, std::pair<uint8_t, Message>>::iterator it = session->inflight.begin(); it != session->inflight.end(); ++it)
+            {
+                if (it->second.first == MQTT_PACKET_PUBREL)
+                    resend.push_back(mqttAckPacket(MQTT_PACKET_PUBREL, it->first));
+                else
+                    resend.push_back(publishPacket(it->second.second, it->second.second.qos, it->first, false, true, level));
+            }
+        }
+    }
+
+    if (takenOver)
+    {
+        std::lock_guard<std::mutex> lock(takenOver->writeMutex);
+        if (!takenOver->closed)
+            shutdown(takenOver->fd, SHUT_RDWR);
+    }
+
+    std::string body;
+    body += (char)(sessionPresent ? 1 : 0);
+    if (level == MQTT_PROTOCOL_LEVEL_5)
+    {
+        body += (char)connackReasonCode(returnCode);
+        mqttPutVarint(body, 0);
+    }
+    else
+    {
+        body += (char)returnCode;
+    }
+    // The CONNACK carries the version being answered, even when refusing it
+    if (connection->version == 0)
+        connection->version = level == MQTT_PROTOCOL_LEVEL_5 ? level : MQTT_PROTOCOL_LEVEL_311;
+    send(connection, mqttPacket(MQTT_PACKET_CONNACK << 4, body));
+    if (returnCode != 0)
+    {
+        connection->hasWill = false;
+        return false;
+    }
+
+    for (std::size_t i = 0; i < resend.size(); i++)
+        send(connection, resend[i]);
+    return true;
+}
+
+bool ESP32MQTTLoopbackBroker::handlePublish(const std::shared_ptr<Connection> &connection, uint8_t header, MqttReader &reader)
+{
+    Message message;
+    std::size_t length;
+    const char *topic = reader.string(length);
+    message.topic.assign(topic, length);
+    message.qos = (header >> 1) & 3;
+    message.retain = header & 0x01;
+    uint16_t id = message.qos ? reader.u16() : 0;
+    if (connection->version == MQTT_PROTOCOL_LEVEL_5)
+        reader.skip(reader.varint());
+    if (!reader.ok || message.qos > 2 || message.topic.empty())
+        return false;
+    message.payload.assign(reinterpret_cast<const char *>(reader.data + reader.pos), reader.remaining());
+
+    bool duplicate = false;
+    if (message.qos == 2)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::vector<uint16_t> &received = connection->session->receivedQos2;
+        for (std::size_t i = 0; i < received.size() && !duplicate; i++)
+            duplicate = received[i] == id;
+        if (!duplicate)
+            received.push_back(id);
+    }
+
+    if (!duplicate)
+        route(message);
+
+    if (message.qos == 1)
+        send(connection, mqttAckPacket(MQTT_PACKET_PUBACK, id));
+    else if (message.qos == 2)
+        send(connection, mqttAckPacket(MQTT_PACKET_PUBREC, id));
+    return true;
+}
+
+bool ESP32MQTTLoopbackBroker::handleSubscribe(const std::shared_ptr<Connection> &connection, MqttReader &reader, bool subscribe)
+{
+    uint16_t id = reader.u16();
+    if (connection->version == MQTT_PROTOCOL_LEVEL_5)
+        reader.skip(reader.varint());
+
+    std::string codes;
+    std::vector<std::pair<std::shared_ptr<Connection>, std::string>> retained;
+    while (reader.ok && reader.remaining() > 0)
+    {
+        std::size_t length;
+        const char *data = reader.string(length);
+        std::string filter(data, length);
+        uint8_t qos = subscribe ? reader.u8() & 3 : 0;
+        if (!reader.ok)
+            return false;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::shared_ptr<Session> session = connection->session;
+        std::vector<std::pair<std::string, uint8_t>> &subscriptions = session->subscriptions;
+        for (std::size_t i = 0; i < subscriptions.size(); i++)
+        {
+            if (subscriptions[i].first == filter)
+            {
+                subscriptions.erase(subscriptions.begin() + i);
+                break;
+            }
+        }
+
+        if (!subscribe)
+        {
+            if (connection->version == MQTT_PROTOCOL_LEVEL_5)
+                codes += (char)0x00;
+            continue;
+        }
+
+        if (filter.empty() || !mqttTopicFilterValid(filter.c_str()) || qos > 2)
+        {
+            codes += (char)0x80;
+            continue;
+        }
+        subscriptions.push_back({filter, qos});
+        codes += (char)qos;
+
+        for (std::map<std::string, Message>::iterator it = _retained.begin(); it != _retained.end(); ++it)
+        {
+            if (mqttStaticTopicMatch(filter.c_str(), it->first.data(), it->first.size()))
+                deliver(session, it->second, it->second.qos < qos ? it->second.qos : qos, true, retained);
+        }
+    }
+    if (!reader.ok)
+        return false;
+
+    std::string body;
+    mqttPut16(body, id);
+    if (connection->version == MQTT_PROTOCOL_LEVEL_5)
+        mqttPutVarint(body, 0);
+    body += codes;
+    send(connection, mqttPacket((subscribe ? MQTT_PACKET_SUBACK : MQTT_PACKET_UNSUBACK) << 4, body));
+
+    for (std::size_t i = 0; i < retained.size(); i++)
+        send(retained[i].first, retained[i].second);
+    return true;
+}
+
+void ESP32MQTTLoopbackBroker::route(const Message &message)
+{
+    std::vector<std::pair<std::shared_ptr<Connection>, std::string>> out;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (message.retain)
+        {
+            if (message.payload.empty())
+                _retained.erase(message.topic);
+            else
+                _retained[message.topic] = message;
+        }
+
+        for (std::map<std::string, std::shared_ptr<Session>>::iterator it = _sessions.begin(); it != _sessions.end(); ++it)
+        {
+            // Overlapping subscriptions of a session get the message once, at their highest QoS
+            int qos = -1;
+            const std::vector<std::pair<std::string, uint8_t>> &subscriptions = it->second->subscriptions;
+            for (std::size_t i = 0; i < subscriptions.size(); i++)
+            {
+                if (subscriptions[i].second > qos && mqttStaticTopicMatch(subscriptions[i].first.c_str(), message.topic.data(), message.topic.size()))
+                    qos = subscriptions[i].second;
+            }
+            if (qos >= 0)
+                deliver(it->second, message, message.qos < qos ? message.qos : qos, false, out);
+        }
+    }
+
+    for (std::size_t i = 0; i < out.size(); i++)
+        send(out[i].first, out[i].second);
+}
+
+std::string ESP32MQTTLoopbackBroker::publishPacket(const Message &message, uint8_t qos, uint16_t packetId, bool retain, bool dup, uint8_t version)
+{
+    std::string body;
+    mqttPutString(body, message.topic.data(), message.topic.size());
+    if (qos)
+        mqttPut16(body, packetId);
+    if (version == MQTT_PROTOCOL_LEVEL_5)
+        mqttPutVarint(body, 0);
+    body += message.payload;
+    return mqttPacket(MQTT_PACKET_PUBLISH << 4 | (dup ? 0x08 : 0) | qos << 1 | (retain ? 1 : 0), body);
+}
+
+/**
+ * Queue a message for a session, called with _mutex held
+ *
+ * @param out collects the packets to send once _mutex is released
+ */
+void ESP32MQTTLoopbackBroker::deliver(const std::shared_ptr<Session> &session, const Message &message, uint8_t qos, bool retain,
+                                      std::vector<std::pair<std::shared_ptr<Connection>, std::string>> &out)
+{
+    uint16_t id = 0;
+    if (qos > 0)
+    {
+        // QoS>0 is kept until acknowledged, offline persistent sessions get it on reconnection
+        do
+        {
+            id = ++session->nextId ? session->nextId : ++session->nextId;
+        } while (session->inflight.count(id));
+        Message stored = message;
+        stored.qos = qos;
+        session->inflight[id] = std::make_pair((uint8_t)MQTT_PACKET_PUBLISH, stored);
+    }
+
+    if (session->connection)
+        out.push_back({session->connection, publishPacket(message, qos, id, retain, false, session->connection->version)});
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include "ESP32MQTTHostPacket.h"
+
+/*
+ * Minimal in-process MQTT 3.1.1 / 5 broker on 127.0.0.1, for end-to-end runs of ESP32MQTTClient
+ * on a Linux host through host/ESP32MQTTHostTransport.cpp.
+ *
+ * Supports what the client uses: QoS 0/1/2 both ways, wildcard subscriptions, retained messages,
+ * last will, persistent sessions (clean session / clean start off) with redelivery of unacknowledged
+ * messages. No authentication, no topic aliases, MQTT 5 properties are ignored.
+ *
+ * Faults are scripted per packet type and direction, and fire on the nth matching packet, so a
+ * run is reproducible:
+ *
+ *     broker.addFaults("out CONNACK delay 200; out PUBACK#3 drop; in PUBLISH#50 disconnect; out SUBACK partial 2 100");
+ *
+ * "out" is broker to client, "in" client to broker. Without "#n" the fault applies to every matching
+ * packet. Actions: "delay <ms>", "drop", "disconnect" (close the TCP connection, the will is published),
+ * "partial <bytes> <ms>" (send the first bytes, pause, send the rest; a delay for "in" packets).
+ */
+class ESP32MQTTLoopbackBroker
+{
+public:
+    enum FaultDirection : uint8_t
+    {
+        FAULT_OUT, // Broker to client
+        FAULT_IN   // Client to broker
+    };
+
+    enum FaultAction : uint8_t
+    {
+        FAULT_DELAY,
+        FAULT_DROP,
+        FAULT_DISCONNECT,
+        FAULT_PARTIAL
+    };
+
+    struct Fault
+    {
+        FaultDirection direction;
+        uint8_t packetType;  // MqttPacketType, 0 for any packet
+        uint32_t occurrence; // Fires once on the nth matching packet from now on, 0: on every one
+        FaultAction action;
+        uint32_t delayMs;    // FAULT_DELAY, and the pause of FAULT_PARTIAL
+        uint32_t bytes;      // FAULT_PARTIAL: bytes sent before the pause
+        uint32_t seen;       // Matching packets so far
+    };
+
+    struct Stats
+    {
+        uint32_t connections;
+        uint32_t packetsIn;
+        uint32_t packetsOut;
+        uint32_t publishesIn;
+        uint32_t publishesOut;
+        uint32_t faultsFired;
+    };
+
+    ESP32MQTTLoopbackBroker();
+    ~ESP32MQTTLoopbackBroker();
+
+    bool start(uint16_t port = 0); // 0: any free port. The same port can be started again after stop()
+    void stop();                   // Drops every connection, sessions and retained messages are kept
+    inline uint16_t port() const { return _port; };
+    std::string uri() const; // mqtt://127.0.0.1:<port>
+
+    void addFault(FaultDirection direction, uint8_t packetType, uint32_t occurrence, FaultAction action, uint32_t delayMs = 0, uint32_t bytes = 0);
+    bool addFaults(const char *script); // See above, false on a syntax error (the faults before it are kept)
+    void clearFaults();
+
+    void setRefuseConnections(uint8_t returnCode); // CONNACK return code for the next connections (MQTT 3.1.1 numbering), 0 to accept again
+    void disconnectClients();                      // Drop every TCP connection now, wills are published
+    void publish(const std::string &topic, const std::string &payload, uint8_t qos = 0, bool retain = false); // As if another client published
+
+    std::size_t clientCount();
+    Stats getStats();
+
+private:
+    struct Message
+    {
+        std::string topic;
+        std::string payload;
+        uint8_t qos;
+        bool retain;
+    };
+
+    struct Connection;
+
+    struct Session
+    {
+        std::string clientId;
+        bool clean;
+        std::vector<std::pair<std::string, uint8_t>> subscriptions; // filter, QoS
+        std::map<uint16_t, std::pair<uint8_t, Message>> inflight;  // packet id -> PUBLISH or PUBREL sent, and the message
+        std::vector<uint16_t> receivedQos2;                         // Incoming QoS 2 ids until PUBREL
+        uint16_t nextId;
+        std::shared_ptr<Connection> connection;
+    };
+
+    struct Connection
+    {
+        int fd;
+        uint8_t version; // MQTT_PROTOCOL_LEVEL_311 or _5, once connected
+        std::atomic<bool> closed; // Written under writeMutex, polled under _mutex
+        bool graceful;
+        bool hasWill;
+        Message will;
+        std::shared_ptr<Session> session;
+        std::mutex writeMutex;
+        std::thread thread;
+    };
+
+    std::mutex _mutex; // Sessions, retained messages, faults, connections
+    int _listenFd;
+    uint16_t _port;
+    std::atomic<bool> _running;
+    std::thread _acceptTask;
+    std::vector<std::shared_ptr<Connection>> _connections;
+    std::map<std::string, std::shared_ptr<Session>> _sessions;
+    std::map<std::string, Message> _retained;
+    std::vector<Fault> _faults;
+    uint8_t _refuseCode;
+    Stats _stats;
+
+    void acceptTaskLoop();
+    void connectionTaskLoop(std::shared_ptr<Connection> connection);
+    bool packetFault(FaultDirection direction, uint8_t packetType, Fault &fault);
+    void send(const std::shared_ptr<Connection> &connection, const std::string &packet);
+    void closeConnection(const std::shared_ptr<Connection> &connection);
+    bool handlePacket(const std::shared_ptr<Connection> &connection, const std::string &packet);
+    bool handleConnect(const std::shared_ptr<Connection> &connection, MqttReader &reader);
+    bool handlePublish(const std::shared_ptr<Connection> &connection, uint8_t header, MqttReader &reader);
+    bool handleSubscribe(const std::shared_ptr<Connection> &connection, MqttReader &reader, bool subscribe);
+    void route(const Message &message);
+    std::string publishPacket(const Message &message, uint8_t qos, uint16_t packetId, bool retain, bool dup, uint8_t version);
+    void deliver(const std::shared_ptr<Session> &session, const Message &message, uint8_t qos, bool retain, std::vector<std::pair<std::shared_ptr<Connection>, std::string>> &out);
+};
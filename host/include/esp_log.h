@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_timer.h"
+
+// ESP-IDF style log lines on stderr, "I (<ms>) <tag>: <message>"
+#define ESP_HOST_LOG(letter, tag, format, ...) \
+    fprintf(stderr, letter " (%lld) %s: " format "\n", (long long)(esp_timer_get_time() / 1000), tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...) ESP_HOST_LOG("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_HOST_LOG("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_HOST_LOG("I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) do { } while (0)
+#define ESP_LOGV(tag, format, ...) do { } while (0)
@@ -0,0 +1,11 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void esp_restart(void); // Exits the process, there is nothing to restart on a host
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,5 @@
+#pragma once
+
+// The host SHA-256 in host/ESP32MQTTHostSha256.cpp follows the mbedtls 3.x API
+#define MBEDTLS_VERSION_NUMBER 0x03060000
+#define MBEDTLS_VERSION_STRING "3.6.0"
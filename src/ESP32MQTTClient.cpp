@@ -1,12 +1,23 @@
 #include "ESP32MQTTClient.h"
 #include "esp_timer.h"
 #include "esp_system.h"
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef ESP_PLATFORM
+#include "esp_pthread.h"
+#endif
 
 static const char *TAG = "ESP32MQTTClient";
 
 ESP32MQTTClient::ESP32MQTTClient(/* args */)
 {
     memset(&_mqtt_config, 0, sizeof(_mqtt_config));
+    _mqtt_client = nullptr;
+    _topicPrefix = nullptr;
     _mqttConnected = false;
     _mqttMaxInPacketSize = DEFAULT_PACKET_SIZE;
     _mqttMaxOutPacketSize = _mqttMaxInPacketSize;
@@ -16,10 +27,71 @@ ESP32MQTTClient::ESP32MQTTClient(/* args */)
     _mqttLastWillRetain = false;
     _mqttUriBuffer = nullptr;
     _globalMessageReceivedCallback = nullptr;
+    _duplicateFilterNext = 0;
+    _inboundNextLane = 0;
+    _inboundRunning = false;
+    _mqttReceiveMaximum = 0;
+    _minimalSubscriptions = false;
+    _subscriptionSyncPending = false;
+    _currentBroker = 0;
+    _preferredBroker = 0;
+    _failoverThreshold = DEFAULT_FAILOVER_THRESHOLD;
+    _brokerRecheckMs = DEFAULT_BROKER_RECHECK_MS;
+    _brokerErrors = 0;
+    _brokerSwitched = false;
+    _brokerSwitching = false;
+    _failoverRequested = false;
+    _connectStartUs = 0;
+    _failoverRunning = false;
+    _bulkBytesPerSecond = 0;
+    _bulkBurstBytes = 0;
+    _bulkTokens = 0;
+    _bulkRefillUs = 0;
+    _bulkCredit = 0;
+    _outboundReserved = false;
+    _outboundRunning = false;
+    setPublishLane(PRIORITY_CRITICAL, 16, 8);
+    setPublishLane(PRIORITY_NORMAL, 64, 8);
+    setPublishLane(PRIORITY_BULK, 256, 4);
+    for (uint8_t i = 0; i < PRIORITY_COUNT; i++)
+    {
+        _outboundLanes[i].totalDelayUs = 0;
+        memset(&_outboundLanes[i].stats, 0, sizeof(_outboundLanes[i].stats));
+    }
+    _stats.duplicatesDropped = 0;
+    _stats.inboundDropped = 0;
+    _stats.brokerSwitches = 0;
 }
 
 ESP32MQTTClient::~ESP32MQTTClient()
 {
+    if (_failoverTask.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_failoverMutex);
+            _failoverRunning = false;
+        }
+        _failoverCondition.notify_all();
+        _failoverTask.join();
+    }
+    if (_inboundTask.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_inboundMutex);
+            _inboundRunning = false;
+        }
+        _inboundCondition.notify_all();
+        _inboundTask.join();
+    }
+    if (_outboundTask.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_outboundMutex);
+            _outboundRunning = false;
+        }
+        _outboundCondition.notify_all();
+        _outboundTask.join();
+    }
     esp_mqtt_client_destroy(_mqtt_client);
     if (_mqttUriBuffer != nullptr) {
         free(_mqttUriBuffer);
@@ -56,6 +128,17 @@ void ESP32MQTTClient::setTaskPrio(int prio)
     setConfigTaskPrio(prio);
 }
 
+void ESP32MQTTClient::enableTracing(const std::size_t capacity)
+{
+    _trace.enable(capacity);
+}
+
+void ESP32MQTTClient::enableDuplicateFilter(const uint8_t windowSize)
+{
+    _duplicateFilterWindow.assign(windowSize, {-1, 0});
+    _duplicateFilterNext = 0;
+}
+
 void ESP32MQTTClient::setClientCert(const char *clientCert)
 {
     setConfigClientCert(clientCert);
@@ -103,6 +186,16 @@ bool ESP32MQTTClient::setMaxPacketSize(const uint16_t size)
 }
 
 bool ESP32MQTTClient::publish(const std::string &topic, const std::string &payload, int qos, bool retain)
+{
+    return publish(topic, reinterpret_cast<const uint8_t *>(payload.data()), payload.size(), qos, retain);
+}
+
+bool ESP32MQTTClient::publish(const std::string &topic, const uint8_t *payload, std::size_t length, int qos, bool retain)
+{
+    return publish(topic.c_str(), payload, length, qos, retain);
+}
+
+bool ESP32MQTTClient::publish(const char *topic, const uint8_t *payload, std::size_t length, int qos, bool retain)
 {
     // Do not try to publish if MQTT is not connected.
     if (!isConnected()) //! isConnected())
@@ -114,15 +207,20 @@ bool ESP32MQTTClient::publish(const std::string &topic, const std::string &paylo
     }
 
     bool success = false;
-    if (esp_mqtt_client_publish(_mqtt_client, topic.c_str(), payload.c_str(), 0, qos, retain) != -1)
     {
-        success = true;
+        ESP32MQTTTraceScope span(_trace, "publish", -1, ESP32MQTTTrace::LANE_CALLER);
+        int msgId = esp_mqtt_client_publish(_mqtt_client, topic, reinterpret_cast<const char *>(payload), length, qos, retain);
+        span.setMsgId(msgId);
+        if (msgId != -1)
+        {
+            success = true;
+        }
     }
 
     if (_enableSerialLogs)
     {
         if (success)
-            ESP_LOGI(TAG, "MQTT << [%s] %s", topic.c_str(), payload.c_str());
+            ESP_LOGI(TAG, "MQTT << [%s] %.*s", topic, (int)length, reinterpret_cast<const char *>(payload));
         else
             ESP_LOGW(TAG, "Publish failed, is the message too long ? (see setMaxPacketSize())"); // This can occurs if the message is too long according to the maximum defined in PubsubClient.h
     }
@@ -130,10 +228,98 @@ bool ESP32MQTTClient::publish(const std::string &topic, const std::string &paylo
     return success;
 }
 
+bool ESP32MQTTClient::publish(PublishPriority priority, const std::string &topic, const std::string &payload, int qos, bool retain)
+{
+    if (priority >= PRIORITY_COUNT)
+        return false;
+
+    ESP32MQTTTraceScope span(_trace, "enqueue", -1, ESP32MQTTTrace::LANE_CALLER);
+    {
+        std::lock_guard<std::mutex> lock(_outboundMutex);
+        OutboundLane &lane = _outboundLanes[priority];
+        if (lane.queue.size() >= lane.queueDepth)
+        {
+            lane.stats.dropped++;
+            if (_enableSerialLogs)
+                ESP_LOGW(TAG, "MQTT! publish lane %u full, dropping [%s]", (unsigned)priority, topic.c_str());
+            return false;
+        }
+
+        lane.queue.push_back({topic, payload, qos, retain, esp_timer_get_time()});
+        if (lane.queue.size() > lane.stats.queueHighWater)
+            lane.stats.queueHighWater = lane.queue.size();
+        lane.stats.queued = lane.queue.size();
+
+        if (!_outboundTask.joinable())
+        {
+            _outboundRunning = true;
+            startTask(_outboundTask, "mqtt_outbound", &ESP32MQTTClient::outboundTaskLoop);
+        }
+    }
+    _outboundCondition.notify_one();
+
+    return true;
+}
+
+bool ESP32MQTTClient::setPublishLane(PublishPriority priority, uint16_t queueDepth, uint8_t inflightBudget)
+{
+    if (priority >= PRIORITY_COUNT || queueDepth == 0 || inflightBudget == 0)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(_outboundMutex);
+        _outboundLanes[priority].queueDepth = queueDepth;
+        _outboundLanes[priority].inflightBudget = inflightBudget;
+    }
+    _outboundCondition.notify_one();
+
+    return true;
+}
+
+void ESP32MQTTClient::setBulkRate(uint32_t bytesPerSecond, uint32_t burstBytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(_outboundMutex);
+        _bulkBytesPerSecond = bytesPerSecond;
+        _bulkBurstBytes = burstBytes ? burstBytes : bytesPerSecond;
+        _bulkTokens = _bulkBurstBytes;
+        _bulkRefillUs = esp_timer_get_time();
+        _bulkCredit = 0;
+    }
+    _outboundCondition.notify_one();
+}
+
+ESP32MQTTClient::Stats ESP32MQTTClient::getStats() const
+{
+    Stats stats;
+    stats.duplicatesDropped = _stats.duplicatesDropped;
+    stats.inboundDropped = _stats.inboundDropped;
+    stats.brokerSwitches = _stats.brokerSwitches;
+    return stats;
+}
+
+bool ESP32MQTTClient::getPublishLaneStats(PublishPriority priority, PublishLaneStats &stats)
+{
+    if (priority >= PRIORITY_COUNT)
+        return false;
+
+    std::lock_guard<std::mutex> lock(_outboundMutex);
+    const OutboundLane &lane = _outboundLanes[priority];
+    stats = lane.stats;
+    stats.avgDelayUs = lane.stats.sent ? (uint32_t)(lane.totalDelayUs / lane.stats.sent) : 0;
+
+    return true;
+}
+
 bool ESP32MQTTClient::subscribe(const std::string &topic, MessageReceivedCallback messageReceivedCallback, uint8_t qos)
 {
     bool success = false;
-    if (esp_mqtt_client_subscribe(_mqtt_client, topic.c_str(), qos) != -1)
+    if (_minimalSubscriptions)
+    {
+        // Only the record for now, the broker sees the covering filters once synced below
+        success = true;
+    }
+    else if (esp_mqtt_client_subscribe(_mqtt_client, topic.c_str(), qos) != -1)
     {
         success = true;
     }
@@ -141,14 +327,23 @@ bool ESP32MQTTClient::subscribe(const std::string &topic, MessageReceivedCallbac
     if (success)
     {
         // Add the record to the subscription list only if it does not exists.
+        std::lock_guard<std::mutex> lock(_subscriptionListMutex);
         bool found = false;
         for (std::size_t i = 0; i < _topicSubscriptionList.size() && !found; i++)
+        {
             found = _topicSubscriptionList[i].topic == topic;
+            if (found)
+                _topicSubscriptionList[i].qos = qos;
+        }
 
         if (!found)
-            _topicSubscriptionList.push_back({topic, messageReceivedCallback, nullptr});
+            _topicSubscriptionList.push_back({topic, messageReceivedCallback, nullptr, qos, false, nullptr});
     }
 
+    // Not under _subscriptionListMutex: the sync calls esp-mqtt
+    if (success && _minimalSubscriptions)
+        success = syncSubscriptionCover();
+
     if (_enableSerialLogs)
     {
         if (success)
@@ -188,9 +383,21 @@ bool ESP32MQTTClient::unsubscribe(const std::string &topic)
     {
         if (_topicSubscriptionList[i].topic == topic)
         {
-            if (esp_mqtt_client_unsubscribe(_mqtt_client, topic.c_str()) != -1)
+            if (_minimalSubscriptions || esp_mqtt_client_unsubscribe(_mqtt_client, topic.c_str()) != -1)
             {
-                _topicSubscriptionList.erase(_topicSubscriptionList.begin() + i);
+                if (_topicSubscriptionList[i].lane)
+                {
+                    std::lock_guard<std::mutex> lock(_inboundMutex);
+                    for (std::size_t j = 0; j < _inboundLanes.size(); j++)
+                    {
+                        if (_inboundLanes[j] == _topicSubscriptionList[i].lane)
+                            _inboundLanes.erase(_inboundLanes.begin() + j);
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(_subscriptionListMutex);
+                    _topicSubscriptionList.erase(_topicSubscriptionList.begin() + i);
+                }
                 i--;
 
                 if (_enableSerialLogs)
@@ -206,16 +413,463 @@ bool ESP32MQTTClient::unsubscribe(const std::string &topic)
         }
     }
 
+    if (_minimalSubscriptions)
+        return syncSubscriptionCover();
+
+    return true;
+}
+
+void ESP32MQTTClient::enableMinimalSubscriptions(const bool enabled)
+{
+    _minimalSubscriptions = enabled;
+}
+
+/**
+ * Whether every topic matched by a topic filter is also matched by another one
+ *
+ * @param general is the topic filter that may cover
+ * @param specific is the topic filter that may be covered
+ * @return true if general matches everything specific matches
+ */
+static bool mqttFilterCovers(const std::string &general, const std::string &specific)
+{
+    // Wildcards in the first level do not match topics starting with '$' ($SYS/...)
+    bool systemTopic = !specific.empty() && specific[0] == '$';
+    std::size_t g = 0, s = 0;
+    while (g <= general.size())
+    {
+        std::size_t gEnd = general.find('/', g);
+        if (gEnd == std::string::npos)
+            gEnd = general.size();
+        bool wildcard = general.compare(g, gEnd - g, "#") == 0 || general.compare(g, gEnd - g, "+") == 0;
+        if (wildcard && g == 0 && systemTopic)
+            return false;
+
+        // '#' covers the remaining levels, and the parent level too
+        if (general.compare(g, gEnd - g, "#") == 0)
+            return true;
+        if (s > specific.size())
+            return false;
+
+        std::size_t sEnd = specific.find('/', s);
+        if (sEnd == std::string::npos)
+            sEnd = specific.size();
+
+        // Only '#' covers '#', '+' covers any other single level
+        if (specific.compare(s, sEnd - s, "#") == 0)
+            return false;
+        if (!wildcard && general.compare(g, gEnd - g, specific, s, sEnd - s) != 0)
+            return false;
+
+        g = gEnd + 1;
+        s = sEnd + 1;
+    }
+
+    return s > specific.size();
+}
+
+// Topic filter and QoS of each subscription, copied for the tasks other than the one subscribing
+std::vector<std::pair<std::string, uint8_t>> ESP32MQTTClient::subscriptionFilters()
+{
+    std::lock_guard<std::mutex> lock(_subscriptionListMutex);
+    std::vector<std::pair<std::string, uint8_t>> filters;
+    filters.reserve(_topicSubscriptionList.size());
+    for (std::size_t i = 0; i < _topicSubscriptionList.size(); i++)
+        filters.push_back({_topicSubscriptionList[i].topic, _topicSubscriptionList[i].qos});
+    return filters;
+}
+
+/**
+ * Bring the broker side subscriptions to the minimal covering set of the subscription list.
+ * Runs from the calling task or the MQTT task: the MQTT task must never wait for _subscriptionMutex,
+ * the task holding it may be waiting for the esp-mqtt lock, so a sync requested meanwhile is run
+ * again by the task holding it.
+ */
+bool ESP32MQTTClient::syncSubscriptionCover()
+{
+    bool success = true;
+    std::unique_lock<std::mutex> lock(_subscriptionEventMutex);
+    _subscriptionSyncPending = true;
+    while (_subscriptionSyncPending && _subscriptionMutex.try_lock())
+    {
+        _subscriptionSyncPending = false;
+        std::vector<std::pair<int, SubscriptionEvent>> events;
+        events.swap(_subscriptionEvents);
+        lock.unlock();
+        success = updateSubscriptionCover(events);
+        _subscriptionMutex.unlock();
+        lock.lock();
+    }
+
+    return success;
+}
+
+// Called from the MQTT task, see syncSubscriptionCover()
+void ESP32MQTTClient::postSubscriptionEvent(int msgId, SubscriptionEvent event)
+{
+    std::lock_guard<std::mutex> lock(_subscriptionEventMutex);
+    _subscriptionEvents.push_back({msgId, event});
+}
+
+/**
+ * The cover: filters not covered by another one, each with the highest QoS among the filters it covers.
+ * A broker subscription no longer needed is only unsubscribed once every filter it covered is
+ * acknowledged on its own, so no message is missed in between. While disconnected nothing is
+ * sent and the broker subscriptions are kept as they are.
+ *
+ * @param events are the SUBACKs and session changes seen by the MQTT task since the last update
+ */
+bool ESP32MQTTClient::updateSubscriptionCover(const std::vector<std::pair<int, SubscriptionEvent>> &events)
+{
+    for (std::size_t e = 0; e < events.size(); e++)
+    {
+        for (std::size_t i = 0; i < _brokerSubscriptions.size(); i++)
+        {
+            BrokerSubscription &subscription = _brokerSubscriptions[i];
+            bool inFlight = subscription.msgId != -1;
+            bool erase = events[e].second == SUBSCRIPTION_SESSION_LOST || (events[e].second == SUBSCRIPTION_SESSION_RESUMED && inFlight) ||
+                         (events[e].second == SUBSCRIPTION_REFUSED && subscription.msgId == events[e].first);
+            if (erase && events[e].second == SUBSCRIPTION_REFUSED && _enableSerialLogs)
+                ESP_LOGW(TAG, "MQTT! broker refused the subscription [%s]", subscription.filter.c_str());
+
+            if (erase)
+                _brokerSubscriptions.erase(_brokerSubscriptions.begin() + i--);
+            else if (events[e].second == SUBSCRIPTION_ACKED && subscription.msgId == events[e].first)
+                subscription.msgId = -1;
+        }
+    }
+
+    // The MQTT task runs this on SUBACKs while the caller's task may be subscribing
+    std::vector<std::pair<std::string, uint8_t>> filters = subscriptionFilters();
+    std::vector<std::pair<std::string, uint8_t>> cover;
+    for (std::size_t i = 0; i < filters.size(); i++)
+    {
+        const std::string &filter = filters[i].first;
+        bool covered = false;
+        uint8_t qos = 0;
+        for (std::size_t j = 0; j < filters.size() && !covered; j++)
+        {
+            if (i == j)
+                continue;
+            if (mqttFilterCovers(filters[j].first, filter))
+                covered = true;
+            else if (mqttFilterCovers(filter, filters[j].first) && filters[j].second > qos)
+                qos = filters[j].second;
+        }
+
+        if (!covered)
+            cover.push_back({filter, filters[i].second > qos ? filters[i].second : qos});
+    }
+
+    bool connected = isConnected();
+    bool success = true;
+    std::vector<BrokerSubscription> subscriptions;
+    std::vector<bool> kept(_brokerSubscriptions.size(), false);
+    for (std::size_t i = 0; i < cover.size(); i++)
+    {
+        // Already asked for, acknowledged or not
+        bool subscribed = false;
+        for (std::size_t j = 0; j < _brokerSubscriptions.size() && !subscribed; j++)
+        {
+            subscribed = _brokerSubscriptions[j].filter == cover[i].first && _brokerSubscriptions[j].qos == cover[i].second;
+            if (subscribed)
+            {
+                subscriptions.push_back(_brokerSubscriptions[j]);
+                kept[j] = true;
+            }
+        }
+        if (subscribed || !connected)
+            continue;
+
+        int msgId = esp_mqtt_client_subscribe(_mqtt_client, cover[i].first.c_str(), cover[i].second);
+        if (msgId == -1)
+        {
+            // Not on the broker list, the next sync tries again
+            success = false;
+            continue;
+        }
+
+        subscriptions.push_back({cover[i].first, cover[i].second, msgId});
+        if (_enableSerialLogs)
+            ESP_LOGI(TAG, "MQTT: Broker subscription [%s] qos %u", cover[i].first.c_str(), cover[i].second);
+    }
+
+    for (std::size_t i = 0; i < _brokerSubscriptions.size(); i++)
+    {
+        const BrokerSubscription &old = _brokerSubscriptions[i];
+        if (kept[i])
+            continue;
+
+        // The broker replaced it on the SUBACK of the same filter at another QoS
+        bool replaced = false;
+        for (std::size_t j = 0; j < subscriptions.size() && !replaced; j++)
+            replaced = subscriptions[j].filter == old.filter && subscriptions[j].msgId == -1;
+        if (replaced)
+            continue;
+
+        // Kept while its own SUBACK is pending, or a filter it covered is not acknowledged on its own yet
+        bool needed = !connected || old.msgId != -1;
+        for (std::size_t j = 0; j < cover.size() && !needed; j++)
+        {
+            if (!mqttFilterCovers(old.filter, cover[j].first))
+                continue;
+            bool acked = false;
+            for (std::size_t k = 0; k < subscriptions.size() && !acked; k++)
+                acked = subscriptions[k].filter == cover[j].first && subscriptions[k].qos == cover[j].second && subscriptions[k].msgId == -1;
+            needed = !acked;
+        }
+
+        if (needed)
+        {
+            subscriptions.push_back(old);
+        }
+        else if (esp_mqtt_client_unsubscribe(_mqtt_client, old.filter.c_str()) == -1)
+        {
+            subscriptions.push_back(old);
+            success = false;
+        }
+        else if (_enableSerialLogs)
+        {
+            ESP_LOGI(TAG, "MQTT: Broker subscription [%s] covered, unsubscribed", old.filter.c_str());
+        }
+    }
+
+    _brokerSubscriptions.swap(subscriptions);
+    return success;
+}
+
+bool ESP32MQTTClient::subscribeStaticRange(const ESP32MQTTStaticRoute *routes, std::size_t count, uint8_t qos)
+{
+    bool success = true;
+    for (std::size_t i = 0; i < count && success; i++)
+        success = esp_mqtt_client_subscribe(_mqtt_client, routes[i].filter, qos) != -1;
+
+    if (success)
+    {
+        // Register the table only once, it is subscribed again on every reconnection
+        bool found = false;
+        for (std::size_t i = 0; i < _staticRouteTables.size() && !found; i++)
+            found = _staticRouteTables[i].routes == routes;
+
+        if (!found)
+            _staticRouteTables.push_back({routes, count, qos});
+    }
+
+    if (_enableSerialLogs)
+    {
+        if (success)
+            ESP_LOGI(TAG, "MQTT: Subscribed to %u static routes", (unsigned)count);
+        else
+            ESP_LOGW(TAG, "MQTT! static subscribe failed");
+    }
+
+    return success;
+}
+
+bool ESP32MQTTClient::unsubscribeStatic(const ESP32MQTTStaticRoute *routes)
+{
+    // Do not try to unsubscribe if MQTT is not connected.
+    if (!isConnected())
+    {
+        if (_enableSerialLogs)
+            ESP_LOGW(TAG, "Trying to unsubscribe when disconnected, skipping.");
+
+        return false;
+    }
+
+    for (std::size_t i = 0; i < _staticRouteTables.size(); i++)
+    {
+        if (_staticRouteTables[i].routes == routes)
+        {
+            for (std::size_t j = 0; j < _staticRouteTables[i].count; j++)
+            {
+                if (esp_mqtt_client_unsubscribe(_mqtt_client, routes[j].filter) == -1)
+                {
+                    if (_enableSerialLogs)
+                        ESP_LOGW(TAG, "MQTT! unsubscribe failed");
+
+                    return false;
+                }
+            }
+            _staticRouteTables.erase(_staticRouteTables.begin() + i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ESP32MQTTClient::setFlowControl(const std::string &topic, uint16_t maxRatePerSecond, uint16_t queueDepth, OverloadPolicy policy, uint16_t sampleEvery)
+{
+    TopicSubscriptionRecord *record = nullptr;
+    for (std::size_t i = 0; i < _topicSubscriptionList.size() && record == nullptr; i++)
+    {
+        if (_topicSubscriptionList[i].topic == topic)
+            record = &_topicSubscriptionList[i];
+    }
+
+    if (record == nullptr || queueDepth == 0)
+    {
+        if (_enableSerialLogs)
+            ESP_LOGW(TAG, "MQTT! flow control needs a subscribed topic and a queue depth, skipping [%s]", topic.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(_inboundMutex);
+    if (!record->lane)
+    {
+        record->lane = std::make_shared<InboundLane>();
+        record->lane->overloadCount = 0;
+        record->lane->nextDeliveryUs = 0;
+        memset(&record->lane->stats, 0, sizeof(record->lane->stats));
+        _inboundLanes.push_back(record->lane);
+    }
+    record->lane->callback = record->callback;
+    record->lane->callbackWithTopic = record->callbackWithTopic;
+    record->lane->minIntervalUs = maxRatePerSecond ? 1000000 / maxRatePerSecond : 0;
+    record->lane->queueDepth = queueDepth;
+    record->lane->policy = policy;
+    record->lane->sampleEvery = sampleEvery ? sampleEvery : 1;
+
+    if (!_inboundTask.joinable())
+    {
+        _inboundRunning = true;
+        startTask(_inboundTask, "mqtt_inbound", &ESP32MQTTClient::inboundTaskLoop);
+    }
+
+    return true;
+}
+
+bool ESP32MQTTClient::getSubscriptionStats(const std::string &topic, SubscriptionStats &stats)
+{
+    for (std::size_t i = 0; i < _topicSubscriptionList.size(); i++)
+    {
+        if (_topicSubscriptionList[i].topic == topic)
+        {
+            if (_topicSubscriptionList[i].lane)
+            {
+                std::lock_guard<std::mutex> lock(_inboundMutex);
+                stats = _topicSubscriptionList[i].lane->stats;
+            }
+            else
+            {
+                memset(&stats, 0, sizeof(stats));
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ESP32MQTTClient::setReceiveMaximum(uint16_t receiveMaximum)
+{
+    _mqttReceiveMaximum = receiveMaximum;
+}
+
+bool ESP32MQTTClient::setDuplicateFilter(const std::string &topic, bool enabled)
+{
+    bool found = false;
+    for (std::size_t i = 0; i < _topicSubscriptionList.size(); i++)
+    {
+        if (_topicSubscriptionList[i].topic == topic)
+        {
+            _topicSubscriptionList[i].acceptDuplicates = !enabled;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+bool ESP32MQTTClient::exportTraceToFile(const char *path) const
+{
+    FILE *file = fopen(path, "w");
+    if (file == nullptr)
+    {
+        if (_enableSerialLogs)
+            ESP_LOGW(TAG, "Trace export: cannot open %s", path);
+        return false;
+    }
+
+    _trace.exportJson([file](const char *data, std::size_t length)
+                      { fwrite(data, 1, length, file); });
+    return fclose(file) == 0;
+}
+
+void ESP32MQTTClient::printTrace() const
+{
+    _trace.exportJson([](const char *data, std::size_t length)
+                      { fwrite(data, 1, length, stdout); });
+    fflush(stdout);
+}
+
+bool ESP32MQTTClient::publishTrace(const std::string &topic)
+{
+    std::string json;
+    _trace.exportJson([&json](const char *data, std::size_t length)
+                      { json.append(data, length); });
+    return publish(topic, json, 0, false);
+}
+
+bool ESP32MQTTClient::addBroker(const char *uri, const char *username, const char *password)
+{
+    if (uri == nullptr)
+        return false;
+
+    _brokers.push_back({uri, username, password, -1, -1});
     return true;
 }
 
+int ESP32MQTTClient::getCurrentBroker() const
+{
+    std::lock_guard<std::mutex> lock(_failoverMutex);
+    return _brokers.empty() ? -1 : (int)_currentBroker;
+}
+
+int32_t ESP32MQTTClient::getBrokerConnectTime(std::size_t index) const
+{
+    std::lock_guard<std::mutex> lock(_failoverMutex);
+    return index < _brokers.size() ? _brokers[index].connectUs : -1;
+}
+
+int32_t ESP32MQTTClient::getBrokerConnackTime(std::size_t index) const
+{
+    std::lock_guard<std::mutex> lock(_failoverMutex);
+    return index < _brokers.size() ? _brokers[index].connackUs : -1;
+}
+
 void ESP32MQTTClient::setKeepAlive(uint16_t keepAliveSeconds)
 {
     setConfigKeepAlive(keepAliveSeconds);
 }
 
+void ESP32MQTTClient::setReconnectTimeout(uint32_t reconnectMs)
+{
+    setConfigReconnectTimeout(reconnectMs);
+}
+
 // ================== Private functions ====================-
 
+// Background tasks of the client (inbound delivery, failover, outbound lanes) are std::threads,
+// on ESP-IDF with their own name and a stack large enough for user callbacks
+void ESP32MQTTClient::startTask(std::thread &task, const char *name, void (ESP32MQTTClient::*loop)())
+{
+#ifdef ESP_PLATFORM
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    cfg.stack_size = 4096;
+    cfg.thread_name = name;
+    esp_pthread_set_cfg(&cfg);
+#endif
+    task = std::thread(loop, this);
+#ifdef ESP_PLATFORM
+    cfg = esp_pthread_get_default_config();
+    esp_pthread_set_cfg(&cfg);
+#else
+    (void)name;
+#endif
+}
+
 void ESP32MQTTClient::printError(esp_mqtt_error_codes_t *error_handle)
 {
     switch (error_handle->error_type)
@@ -370,6 +1024,15 @@ void ESP32MQTTClient::setConfigKeepAlive(uint16_t seconds)
 #endif
 }
 
+void ESP32MQTTClient::setConfigReconnectTimeout(uint32_t reconnectMs)
+{
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
+    _mqtt_config.reconnect_timeout_ms = reconnectMs;
+#else
+    _mqtt_config.network.reconnect_timeout_ms = reconnectMs;
+#endif
+}
+
 void ESP32MQTTClient::setConfigLwt(const char *topic, const char *msg, int qos, bool retain)
 {
 #if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
@@ -400,12 +1063,249 @@ void ESP32MQTTClient::setConfigSessionSettings()
 #endif
 }
 
+// MQTT 5 Receive Maximum, the protocol version goes in the config, the property is set once the client exists
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0) && defined(CONFIG_MQTT_PROTOCOL_5)
+void ESP32MQTTClient::setConfigReceiveMaximum()
+{
+    if (_mqttReceiveMaximum > 0)
+        _mqtt_config.session.protocol_ver = MQTT_PROTOCOL_V_5;
+}
+
+esp_err_t ESP32MQTTClient::setConnectPropertyReceiveMaximum()
+{
+    if (_mqttReceiveMaximum == 0)
+        return ESP_OK;
+
+    esp_mqtt5_connection_property_config_t property = {};
+    property.receive_maximum = _mqttReceiveMaximum;
+    return esp_mqtt5_client_set_connect_property(_mqtt_client, &property);
+}
+#else
+void ESP32MQTTClient::setConfigReceiveMaximum()
+{
+    if (_mqttReceiveMaximum > 0 && _enableSerialLogs)
+        ESP_LOGW(TAG, "Receive Maximum needs MQTT 5 (ESP-IDF >= 5.1 with CONFIG_MQTT_PROTOCOL_5), ignored");
+}
+
+esp_err_t ESP32MQTTClient::setConnectPropertyReceiveMaximum()
+{
+    return ESP_OK;
+}
+#endif
+
+/**
+ * Time a TCP connection to the host and port of a broker URI, the MQTT session itself is not opened
+ * (that would take over the session of our own client id).
+ *
+ * @param uri is mqtt://, mqtts://, ws:// or wss://host[:port][/path]
+ * @return the connect time in us, -1 if the broker could not be reached within timeoutMs
+ */
+static int32_t probeBrokerConnectTime(const char *uri, uint32_t timeoutMs)
+{
+    std::string address(uri);
+    std::string port = "1883";
+    std::size_t schemeEnd = address.find("://");
+    if (schemeEnd != std::string::npos)
+    {
+        std::string scheme = address.substr(0, schemeEnd);
+        if (scheme == "mqtts")
+            port = "8883";
+        else if (scheme == "ws")
+            port = "80";
+        else if (scheme == "wss")
+            port = "443";
+        address.erase(0, schemeEnd + 3);
+    }
+    address = address.substr(0, address.find('/'));
+    std::size_t colon = address.rfind(':');
+    if (colon != std::string::npos)
+    {
+        port = address.substr(colon + 1);
+        address.erase(colon);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *result = nullptr;
+    if (getaddrinfo(address.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr)
+        return -1;
+
+    int32_t elapsed = -1;
+    int sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (sock >= 0)
+    {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        int64_t start = esp_timer_get_time();
+        int ret = connect(sock, result->ai_addr, result->ai_addrlen);
+        if (ret != 0 && errno == EINPROGRESS)
+        {
+            fd_set writable;
+            FD_ZERO(&writable);
+            FD_SET(sock, &writable);
+            struct timeval timeout = {(time_t)(timeoutMs / 1000), (suseconds_t)((timeoutMs % 1000) * 1000)};
+            int error = -1;
+            socklen_t length = sizeof(error);
+            if (select(sock + 1, nullptr, &writable, nullptr, &timeout) == 1 &&
+                getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+                ret = 0;
+        }
+        if (ret == 0)
+            elapsed = (int32_t)(esp_timer_get_time() - start);
+        close(sock);
+    }
+    freeaddrinfo(result);
+
+    return elapsed;
+}
+
+void ESP32MQTTClient::probeBrokers()
+{
+    for (std::size_t i = 0; i < _brokers.size(); i++)
+    {
+        int32_t connectUs = probeBrokerConnectTime(_brokers[i].uri, BROKER_PROBE_TIMEOUT_MS);
+        {
+            std::lock_guard<std::mutex> lock(_failoverMutex);
+            _brokers[i].connectUs = connectUs;
+        }
+        if (_enableSerialLogs)
+            ESP_LOGI(TAG, "Broker %s: %ld us", _brokers[i].uri, (long)connectUs);
+    }
+}
+
+// Point the client at another broker, and reconnect if it is running. Called without _failoverMutex held
+void ESP32MQTTClient::switchBroker(std::size_t index)
+{
+    esp_mqtt_client_config_t config;
+    {
+        std::lock_guard<std::mutex> lock(_failoverMutex);
+        _currentBroker = index;
+        _mqttUri = _brokers[index].uri;
+        _mqttUsername = _brokers[index].username;
+        _mqttPassword = _brokers[index].password;
+        setConfigUri(_mqttUri);
+        setConfigUsername(_mqttUsername);
+        setConfigPassword(_mqttPassword);
+
+        if (_mqtt_client == nullptr)
+            return;
+
+        _stats.brokerSwitches++;
+        _brokerSwitched = true;
+        _brokerSwitching = true;
+        config = _mqtt_config; // esp-mqtt is called without our lock
+    }
+
+    if (_enableSerialLogs)
+        ESP_LOGW(TAG, "Switching to broker %s", _brokers[index].uri);
+
+    // Restart the client rather than disconnect() and reconnect(): esp-mqtt disconnects from its own task and refuses
+    // reconnect() until then, which would leave the switch to the reconnect timeout, or to nothing without auto reconnection.
+    // stop() returns once the MQTT task is gone, start() connects at once
+    esp_mqtt_client_stop(_mqtt_client);
+    setConnectionState(false); // esp-mqtt does not always report a stop as a disconnection
+    esp_mqtt_set_config(_mqtt_client, &config);
+    esp_mqtt_client_start(_mqtt_client);
+
+    std::lock_guard<std::mutex> lock(_failoverMutex);
+    _brokerSwitching = false;
+}
+
+// Failover task: probes and switches brokers away from the MQTT task, probing blocks
+void ESP32MQTTClient::failoverTaskLoop()
+{
+    std::unique_lock<std::mutex> lock(_failoverMutex);
+    while (_failoverRunning)
+    {
+        _failoverCondition.wait_for(lock, std::chrono::milliseconds(_brokerRecheckMs), [this]
+                                    { return _failoverRequested || !_failoverRunning; });
+        if (!_failoverRunning)
+            break;
+
+        bool failover = _failoverRequested;
+        _failoverRequested = false;
+        std::size_t current = _currentBroker;
+        std::size_t target = current;
+        lock.unlock();
+
+        if (failover)
+        {
+            // Fastest reachable broker other than the failing one, the failing one if nothing else answers
+            probeBrokers();
+            lock.lock();
+            for (std::size_t i = 0; i < _brokers.size(); i++)
+            {
+                if (i != current && _brokers[i].connectUs >= 0 &&
+                    (target == current || _brokers[i].connectUs < _brokers[target].connectUs))
+                    target = i;
+            }
+            lock.unlock();
+        }
+        else if (current != _preferredBroker && isConnected())
+        {
+            int32_t connectUs = probeBrokerConnectTime(_brokers[_preferredBroker].uri, BROKER_PROBE_TIMEOUT_MS);
+            lock.lock();
+            _brokers[_preferredBroker].connectUs = connectUs;
+            lock.unlock();
+            if (connectUs >= 0)
+            {
+                if (_enableSerialLogs)
+                    ESP_LOGI(TAG, "Preferred broker %s is back", _brokers[_preferredBroker].uri);
+                target = _preferredBroker;
+            }
+        }
+
+        if (target != current)
+            switchBroker(target);
+
+        lock.lock();
+        _brokerErrors = 0;
+    }
+}
+
+// Subscribe again to everything after moving to a broker that has no session for us
+void ESP32MQTTClient::restoreSubscriptions()
+{
+    if (_minimalSubscriptions)
+    {
+        postSubscriptionEvent(-1, SUBSCRIPTION_SESSION_LOST);
+        syncSubscriptionCover();
+    }
+    else
+    {
+        std::vector<std::pair<std::string, uint8_t>> filters = subscriptionFilters();
+        for (std::size_t i = 0; i < filters.size(); i++)
+            esp_mqtt_client_subscribe(_mqtt_client, filters[i].first.c_str(), filters[i].second);
+    }
+
+    for (std::size_t t = 0; t < _staticRouteTables.size(); t++)
+    {
+        for (std::size_t i = 0; i < _staticRouteTables[t].count; i++)
+            esp_mqtt_client_subscribe(_mqtt_client, _staticRouteTables[t].routes[i].filter, _staticRouteTables[t].qos);
+    }
+}
+
 // Try to connect to the MQTT broker and return True if the connection is successfull (blocking)
 bool ESP32MQTTClient::loopStart()
 {
     bool success = false;
     esp_err_t err = ESP_OK;
 
+    if (!_brokers.empty())
+    {
+        // Start on the fastest reachable broker, it becomes the preferred one
+        probeBrokers();
+        std::size_t best = 0;
+        for (std::size_t i = 1; i < _brokers.size(); i++)
+        {
+            if (_brokers[i].connectUs >= 0 && (_brokers[best].connectUs < 0 || _brokers[i].connectUs < _brokers[best].connectUs))
+                best = i;
+        }
+        _preferredBroker = best;
+        switchBroker(best);
+    }
+
     if (_mqttUri != nullptr)
     {
         if (_enableSerialLogs)
@@ -430,6 +1330,7 @@ bool ESP32MQTTClient::loopStart()
         }
         
         setConfigSessionSettings();
+        setConfigReceiveMaximum();
 
 #if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
         // IDF 4.x
@@ -440,6 +1341,9 @@ bool ESP32MQTTClient::loopStart()
         _mqtt_client = esp_mqtt_client_init(&_mqtt_config);
         err = esp_mqtt_client_register_event(_mqtt_client, MQTT_EVENT_ANY, handleMQTT, this);
 #endif // IDF CHECK
+        if (_mqtt_client != nullptr && err == ESP_OK)
+            err = setConnectPropertyReceiveMaximum();
+
         if (_mqtt_client != nullptr && err == ESP_OK)
         {
             err = esp_mqtt_client_start(_mqtt_client);
@@ -449,6 +1353,12 @@ bool ESP32MQTTClient::loopStart()
         {
             success = false;
         }
+
+        if (success && _brokers.size() > 1 && !_failoverTask.joinable())
+        {
+            _failoverRunning = true;
+            startTask(_failoverTask, "mqtt_failover", &ESP32MQTTClient::failoverTaskLoop);
+        }
     }
     else
     {
@@ -472,45 +1382,319 @@ bool ESP32MQTTClient::loopStart()
 }
 
 /**
- * Matching MQTT topics, handling the eventual presence of a single wildcard character
+ * Matching MQTT topics, handling any number of '+' levels and a trailing '#'
  *
- * @param topic1 is the topic may contain a wildcard
+ * @param topic1 is the topic may contain wildcards
  * @param topic2 must not contain wildcards
  * @return true on MQTT topic match, false otherwise
  */
 bool ESP32MQTTClient::mqttTopicMatch(const std::string &topic1, const std::string &topic2)
 {
-    size_t i = 0;
+    return mqttStaticTopicMatch(topic1.c_str(), topic2.data(), topic2.size());
+}
+
+/**
+ * Check a received QoS>0 message against the duplicate filter window, and remember it.
+ * Only messages carrying the DUP flag are looked up, so a recycled msg_id on a fresh
+ * message can not be mistaken for a redelivery.
+ *
+ * @param event is the MQTT_EVENT_DATA event, read before anything is copied out of it
+ * @return true if the message is a redelivery already seen in the window
+ */
+bool ESP32MQTTClient::isDuplicateMessage(esp_mqtt_event_handle_t event)
+{
+    if (_duplicateFilterWindow.empty() || event->qos == 0)
+        return false;
 
-    if ((i = topic1.find('#')) != std::string::npos)
+    // FNV-1a over topic and payload
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < event->topic_len; i++)
+        hash = (hash ^ (uint8_t)event->topic[i]) * 16777619u;
+    for (int i = 0; i < event->data_len; i++)
+        hash = (hash ^ (uint8_t)event->data[i]) * 16777619u;
+
+    if (event->dup)
     {
-        std::string t1a = topic1.substr(0, i);
-        std::string t1b = topic1.substr(i + 1);
-        if ((t1a.length() == 0 || topic2.rfind(t1a, 0) == 0) &&
-            (t1b.length() == 0 || (topic2.size() >= t1b.size() && topic2.compare(topic2.size() - t1b.size(), t1b.size(), t1b) == 0)))
-            return true;
+        for (std::size_t i = 0; i < _duplicateFilterWindow.size(); i++)
+        {
+            if (_duplicateFilterWindow[i].msgId == event->msg_id && _duplicateFilterWindow[i].hash == hash)
+                return true;
+        }
+    }
+
+    _duplicateFilterWindow[_duplicateFilterNext] = {event->msg_id, hash};
+    _duplicateFilterNext = (_duplicateFilterNext + 1) % _duplicateFilterWindow.size();
+    return false;
+}
+
+// Called from the MQTT task, the message is delivered later by inboundTaskLoop()
+void ESP32MQTTClient::enqueueInbound(InboundLane &lane, const std::string &topic, const std::string &payload)
+{
+    {
+        std::lock_guard<std::mutex> lock(_inboundMutex);
+        if (lane.queue.size() >= lane.queueDepth)
+        {
+            lane.stats.dropped++;
+            _stats.inboundDropped++;
+            switch (lane.policy)
+            {
+            case OVERLOAD_DROP:
+                return;
+            case OVERLOAD_KEEP_LATEST:
+                lane.queue.pop_front();
+                break;
+            case OVERLOAD_SAMPLE:
+                if (lane.overloadCount++ % lane.sampleEvery != 0)
+                    return;
+                lane.queue.pop_front();
+                break;
+            }
+        }
+        else
+        {
+            lane.overloadCount = 0;
+        }
+
+        lane.queue.emplace_back(topic, payload);
+        if (lane.queue.size() > lane.stats.queueHighWater)
+            lane.stats.queueHighWater = lane.queue.size();
+        lane.stats.queued = lane.queue.size();
     }
-    else if ((i = topic1.find('+')) != std::string::npos)
+    _inboundCondition.notify_one();
+}
+
+// Inbound task: deliver queued messages lane by lane, each lane paced at its maximum rate
+void ESP32MQTTClient::inboundTaskLoop()
+{
+    std::unique_lock<std::mutex> lock(_inboundMutex);
+    while (_inboundRunning)
     {
-        std::string t1a = topic1.substr(0, i);
-        std::string t1b = topic1.substr(i + 1);
+        int64_t now = esp_timer_get_time();
+        int64_t wait = -1; // us until a paced lane may deliver again, -1 while nothing is queued
+        std::shared_ptr<InboundLane> lane;
+        for (std::size_t n = 0; n < _inboundLanes.size() && !lane; n++)
+        {
+            std::size_t i = (_inboundNextLane + n) % _inboundLanes.size();
+            if (_inboundLanes[i]->queue.empty())
+                continue;
+
+            if (_inboundLanes[i]->nextDeliveryUs <= now)
+            {
+                lane = _inboundLanes[i];
+                _inboundNextLane = i + 1;
+            }
+            else if (wait < 0 || _inboundLanes[i]->nextDeliveryUs - now < wait)
+            {
+                wait = _inboundLanes[i]->nextDeliveryUs - now;
+            }
+        }
 
-        if ((t1a.length() == 0 || topic2.rfind(t1a, 0) == 0) &&
-            (t1b.length() == 0 || (topic2.size() >= t1b.size() && topic2.compare(topic2.size() - t1b.size(), t1b.size(), t1b) == 0)))
+        if (!lane)
         {
-            if (topic2.substr(t1a.length(), topic2.length() - t1b.length() - t1a.length()).find('/') == std::string::npos)
-                return true;
+            if (wait < 0)
+                _inboundCondition.wait(lock);
+            else
+                _inboundCondition.wait_for(lock, std::chrono::microseconds(wait));
+            continue;
+        }
+
+        std::pair<std::string, std::string> message = std::move(lane->queue.front());
+        lane->queue.pop_front();
+        lane->nextDeliveryUs = now + lane->minIntervalUs;
+        lane->stats.delivered++;
+        lane->stats.queued = lane->queue.size();
+        lock.unlock();
+
+        {
+            ESP32MQTTTraceScope span(_trace, "callback", -1, ESP32MQTTTrace::LANE_INBOUND);
+            if (lane->callback != nullptr)
+                lane->callback(message.second);
+            if (lane->callbackWithTopic != nullptr)
+                lane->callbackWithTopic(message.first, message.second);
         }
+
+        lock.lock();
     }
-    else
+}
+
+/**
+ * Give back the in-flight slot of an acknowledged (or abandoned) QoS>0 publish of the lanes
+ *
+ * @param msgId is the msg_id of the publish. An unknown one is only remembered while the outbound task
+ *              has a publish whose msg_id is not registered yet: any other is not a lane publish
+ */
+void ESP32MQTTClient::releaseOutboundInflight(int msgId)
+{
+    for (std::size_t i = 0; i < _outboundInflight.size(); i++)
     {
-        return topic1 == topic2;
+        if (_outboundInflight[i].first == msgId)
+        {
+            _outboundLanes[_outboundInflight[i].second].stats.inflight--;
+            _outboundInflight.erase(_outboundInflight.begin() + i);
+            return;
+        }
     }
 
-    return false;
+    // Acks of plain publish() calls end up here as well: kept only while a lane publish waits for its msg_id
+    if (_outboundReserved)
+    {
+        if (_outboundEarlyAcks.size() >= MAX_EARLY_ACKS)
+            _outboundEarlyAcks.erase(_outboundEarlyAcks.begin());
+        _outboundEarlyAcks.push_back(msgId);
+    }
+}
+
+// Outbound task: send the highest non empty lane within its in-flight budget, bulk within its token bucket
+void ESP32MQTTClient::outboundTaskLoop()
+{
+    std::unique_lock<std::mutex> lock(_outboundMutex);
+    while (_outboundRunning)
+    {
+        int64_t now = esp_timer_get_time();
+        int64_t wait = -1; // us until the bulk bucket holds enough tokens, -1 while nothing can be sent
+        int priority = -1;
+        int64_t charged = 0; // Bulk tokens taken by the message, refunded if it does not go out
+        if (_bulkBytesPerSecond)
+        {
+            // The fraction of a token is carried over: wake-ups on every enqueue and ack must not starve a slow bucket
+            _bulkCredit += (now - _bulkRefillUs) * _bulkBytesPerSecond;
+            _bulkRefillUs = now;
+            _bulkTokens += _bulkCredit / 1000000;
+            _bulkCredit %= 1000000;
+            if (_bulkTokens >= (int64_t)_bulkBurstBytes)
+            {
+                _bulkTokens = _bulkBurstBytes;
+                _bulkCredit = 0;
+            }
+        }
+
+        for (uint8_t i = 0; i < PRIORITY_COUNT && priority < 0 && isConnected(); i++)
+        {
+            OutboundLane &lane = _outboundLanes[i];
+            if (lane.queue.empty())
+                continue;
+            if (lane.queue.front().qos > 0 && lane.stats.inflight >= lane.inflightBudget)
+                continue;
+
+            if (i == PRIORITY_BULK && _bulkBytesPerSecond)
+            {
+                // A message larger than the burst goes out once the bucket is full, and takes it into debt
+                int64_t cost = lane.queue.front().topic.size() + lane.queue.front().payload.size();
+                int64_t needed = cost < (int64_t)_bulkBurstBytes ? cost : _bulkBurstBytes;
+                if (_bulkTokens < needed)
+                {
+                    wait = (needed - _bulkTokens) * 1000000 / _bulkBytesPerSecond + 1;
+                    continue;
+                }
+                _bulkTokens -= cost;
+                charged = cost;
+            }
+            priority = i;
+        }
+
+        if (priority < 0)
+        {
+            if (wait < 0)
+                _outboundCondition.wait(lock);
+            else
+                _outboundCondition.wait_for(lock, std::chrono::microseconds(wait));
+            continue;
+        }
+
+        OutboundLane &lane = _outboundLanes[priority];
+        OutboundMessage message = std::move(lane.queue.front());
+        lane.queue.pop_front();
+        lane.stats.queued = lane.queue.size();
+        if (message.qos > 0)
+        {
+            // The slot and the reservation are taken now, the ack may come before the msg_id is registered
+            lane.stats.inflight++;
+            _outboundReserved = true;
+        }
+        lock.unlock();
+
+        // Never call esp-mqtt with the lanes locked, the MQTT task takes them on acks while holding the client lock
+        int msgId;
+        {
+            ESP32MQTTTraceScope span(_trace, "publish", -1, ESP32MQTTTrace::LANE_CALLER);
+            msgId = esp_mqtt_client_publish(_mqtt_client, message.topic.c_str(), message.payload.data(), message.payload.size(), message.qos, message.retain);
+            span.setMsgId(msgId);
+        }
+
+        if (_enableSerialLogs)
+        {
+            if (msgId != -1)
+                ESP_LOGI(TAG, "MQTT << [%s] %s (lane %d)", message.topic.c_str(), message.payload.c_str(), priority);
+            else
+                ESP_LOGW(TAG, "Publish failed, is the message too long ? (see setMaxPacketSize())");
+        }
+
+        lock.lock();
+        if (message.qos > 0 && msgId == -1)
+            lane.stats.inflight--;
+        if (msgId == -1 && charged)
+        {
+            _bulkTokens += charged;
+            if (_bulkTokens > (int64_t)_bulkBurstBytes)
+                _bulkTokens = _bulkBurstBytes;
+        }
+
+        // The reservation ends, the other early acks were for plain publish() calls
+        bool acked = false;
+        for (std::size_t i = 0; i < _outboundEarlyAcks.size() && !acked; i++)
+            acked = msgId != -1 && _outboundEarlyAcks[i] == msgId;
+        _outboundEarlyAcks.clear();
+        _outboundReserved = false;
+
+        if (msgId == -1 && !isConnected())
+        {
+            // Lost the connection meanwhile, it goes out first once reconnected
+            lane.queue.push_front(std::move(message));
+            lane.stats.queued = lane.queue.size();
+            continue;
+        }
+
+        if (msgId == -1)
+        {
+            lane.stats.dropped++;
+            continue;
+        }
+
+        uint32_t delay = (uint32_t)(esp_timer_get_time() - message.enqueuedUs);
+        lane.stats.sent++;
+        lane.totalDelayUs += delay;
+        if (delay > lane.stats.maxDelayUs)
+            lane.stats.maxDelayUs = delay;
+
+        if (message.qos > 0)
+        {
+            if (acked)
+                lane.stats.inflight--;
+            else
+                _outboundInflight.push_back({msgId, (uint8_t)priority});
+        }
+    }
+}
+
+void ESP32MQTTClient::dispatchStaticRoutes(const char *topic, std::size_t topicLen, const char *payload, std::size_t length)
+{
+    // Count the topic levels once, routes reject on it before comparing any character
+    std::size_t topicLevels = 1;
+    for (std::size_t i = 0; i < topicLen; i++)
+        topicLevels += topic[i] == '/';
+
+    for (std::size_t t = 0; t < _staticRouteTables.size(); t++)
+    {
+        const StaticRouteTable &table = _staticRouteTables[t];
+        for (std::size_t i = 0; i < table.count; i++)
+        {
+            if (table.routes[i].matches(topic, topicLen, topicLevels))
+                table.routes[i].handler(topic, topicLen, payload, length);
+        }
+    }
 }
 
-void ESP32MQTTClient::onMessageReceivedCallback(const char *topic, char *payload, unsigned int length)
+void ESP32MQTTClient::onMessageReceivedCallback(const char *topic, char *payload, unsigned int length, bool duplicate, int msgId)
 {
     // Determine the actual payload length
     unsigned int strTerminationPos;
@@ -527,31 +1711,47 @@ void ESP32MQTTClient::onMessageReceivedCallback(const char *topic, char *payload
 
     // Create a copy of the payload, don't modify the original buffer
     std::string payloadStr;
-    if (payload && length > 0)
-    {
-        payloadStr = std::string(payload, strTerminationPos);
-    }
-    else
+    std::string topicStr;
     {
-        payloadStr = "";
-    }
+        ESP32MQTTTraceScope span(_trace, "copy", msgId, ESP32MQTTTrace::LANE_EVENT);
+        if (payload && length > 0)
+        {
+            payloadStr.assign(payload, strTerminationPos);
+        }
 
-    std::string topicStr(topic);
+        topicStr.assign(topic);
+    }
 
     // Logging
     if (_enableSerialLogs)
         ESP_LOGI(TAG, "MQTT >> [%s] %s", topic, payloadStr.c_str());
 
     // Call global callback
-    if (_globalMessageReceivedCallback) {
+    if (_globalMessageReceivedCallback && !duplicate) {
+        ESP32MQTTTraceScope span(_trace, "global_callback", msgId, ESP32MQTTTrace::LANE_EVENT);
         _globalMessageReceivedCallback(topicStr, payloadStr);
     }
 
     // Send the message to subscribers
     for (std::size_t i = 0; i < _topicSubscriptionList.size(); i++)
     {
-        if (mqttTopicMatch(_topicSubscriptionList[i].topic, topicStr))
+        if (duplicate && !_topicSubscriptionList[i].acceptDuplicates)
+            continue;
+
+        bool match;
+        {
+            ESP32MQTTTraceScope span(_trace, "match", msgId, ESP32MQTTTrace::LANE_EVENT);
+            match = mqttTopicMatch(_topicSubscriptionList[i].topic, topicStr);
+        }
+
+        if (match && _topicSubscriptionList[i].lane)
+        {
+            ESP32MQTTTraceScope span(_trace, "enqueue", msgId, ESP32MQTTTrace::LANE_EVENT);
+            enqueueInbound(*_topicSubscriptionList[i].lane, topicStr, payloadStr);
+        }
+        else if (match)
         {
+            ESP32MQTTTraceScope span(_trace, "callback", msgId, ESP32MQTTTrace::LANE_EVENT);
             if (_topicSubscriptionList[i].callback != nullptr)
                 _topicSubscriptionList[i].callback(payloadStr);
             if (_topicSubscriptionList[i].callbackWithTopic != nullptr)
@@ -571,31 +1771,142 @@ void ESP32MQTTClient::onEventCallback(esp_mqtt_event_handle_t event)
             if (_enableSerialLogs)
                 ESP_LOGI(TAG, "MQTT -->> onMqttConnect");
             setConnectionState(true);
+            {
+                bool switched = false;
+                if (!_brokers.empty())
+                {
+                    std::lock_guard<std::mutex> lock(_failoverMutex);
+                    _brokers[_currentBroker].connackUs = (int32_t)(esp_timer_get_time() - _connectStartUs);
+                    _brokerErrors = 0;
+                    switched = _brokerSwitched;
+                    _brokerSwitched = false;
+                }
+                if (switched)
+                    restoreSubscriptions();
+                else if (_minimalSubscriptions)
+                    postSubscriptionEvent(-1, event->session_present ? SUBSCRIPTION_SESSION_RESUMED : SUBSCRIPTION_SESSION_LOST);
+            }
+            if (_outboundTask.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_outboundMutex);
+                    if (!event->session_present)
+                    {
+                        // The broker forgot the in-flight publishes, their acks will never come
+                        for (std::size_t i = 0; i < _outboundInflight.size(); i++)
+                            _outboundLanes[_outboundInflight[i].second].stats.inflight--;
+                        _outboundInflight.clear();
+                    }
+                }
+                _outboundCondition.notify_one();
+            }
             onMqttConnect(_mqtt_client);
+            if (_minimalSubscriptions)
+                syncSubscriptionCover(); // Restore the cover even for subscriptions not renewed in onMqttConnect()
             break;
         case MQTT_EVENT_DATA:
             if (_enableSerialLogs)
                 ESP_LOGI(TAG, "MQTT -->> onMqttEventData");
             {
-                std::string topic_str(event->topic, event->topic_len);
-                onMessageReceivedCallback(topic_str.c_str(), event->data, event->data_len);
+                ESP32MQTTTraceScope span(_trace, "receive", event->msg_id, ESP32MQTTTrace::LANE_EVENT);
+                bool duplicate = isDuplicateMessage(event);
+                if (duplicate)
+                {
+                    _trace.instant("duplicate", event->msg_id, ESP32MQTTTrace::LANE_EVENT);
+
+                    // Drop before copying anything, unless a subscription of this topic opted out of the filter
+                    bool accepted = false;
+                    for (std::size_t i = 0; i < _topicSubscriptionList.size() && !accepted; i++)
+                        accepted = _topicSubscriptionList[i].acceptDuplicates &&
+                                   mqttStaticTopicMatch(_topicSubscriptionList[i].topic.c_str(), event->topic, event->topic_len);
+
+                    if (!accepted)
+                    {
+                        _stats.duplicatesDropped++;
+                        if (_enableSerialLogs)
+                            ESP_LOGI(TAG, "MQTT: duplicate of msg_id %d dropped", event->msg_id);
+                        break;
+                    }
+                }
+
+                if (!duplicate && !_staticRouteTables.empty())
+                {
+                    ESP32MQTTTraceScope span(_trace, "static_routes", event->msg_id, ESP32MQTTTrace::LANE_EVENT);
+                    dispatchStaticRoutes(event->topic, event->topic_len, event->data, event->data_len);
+                }
+
+                // Static routes alone never touch the heap
+                if (_topicSubscriptionList.empty() && !_globalMessageReceivedCallback)
+                    break;
+
+                std::string topic_str;
+                {
+                    ESP32MQTTTraceScope span(_trace, "copy", event->msg_id, ESP32MQTTTrace::LANE_EVENT);
+                    topic_str.assign(event->topic, event->topic_len);
+                }
+                onMessageReceivedCallback(topic_str.c_str(), event->data, event->data_len, duplicate, event->msg_id);
             }
 
+            break;
+        case MQTT_EVENT_SUBSCRIBED:
+            if (_minimalSubscriptions)
+            {
+                // Return code 0x80: refused, the subscriptions it was to replace stay
+                bool refused = event->data != nullptr && event->data_len > 0 && (uint8_t)event->data[0] >= 0x80;
+                postSubscriptionEvent(event->msg_id, refused ? SUBSCRIPTION_REFUSED : SUBSCRIPTION_ACKED);
+                syncSubscriptionCover();
+            }
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            _trace.instant("ack", event->msg_id, ESP32MQTTTrace::LANE_EVENT);
+            // Fall through - both free an in-flight slot
+        case MQTT_EVENT_DELETED: // Expired from the esp-mqtt outbox, never acknowledged
+            if (_outboundTask.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_outboundMutex);
+                    releaseOutboundInflight(event->msg_id);
+                }
+                _outboundCondition.notify_one();
+            }
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI("ESP32MQTTClient", "MQTT_EVENT_DISCONNECTED");
             setConnectionState(false);
-            if (_enableSerialLogs)
-                ESP_LOGW(TAG, "MQTT -->> %s disconnected (%lus)", _mqttUri, (unsigned long)(esp_timer_get_time() / 1000000));
+            {
+                bool switching;
+                const char *uri;
+                {
+                    std::lock_guard<std::mutex> lock(_failoverMutex);
+                    switching = _brokerSwitching; // Cleared by switchBroker() once the client runs again
+                    uri = _mqttUri;
+                }
+                if (_enableSerialLogs)
+                    ESP_LOGW(TAG, "MQTT -->> %s disconnected (%lus)%s", uri, (unsigned long)(esp_timer_get_time() / 1000000), switching ? ", switching broker" : "");
+                if (switching)
+                    break; // Not a connection failure
+            }
             
             if (_drasticResetOnConnectionFailures) {
                 ESP_LOGW(TAG, "Drastic reset triggered due to connection failure");
                 esp_restart();
             }
             break;
+        case MQTT_EVENT_BEFORE_CONNECT:
+            _connectStartUs = esp_timer_get_time();
+            break;
         case MQTT_EVENT_ERROR:
             ESP_LOGI("ESP32MQTTClient", "MQTT_EVENT_ERROR");
             printError(event->error_handle);
+            if (_brokers.size() > 1)
+            {
+                std::lock_guard<std::mutex> lock(_failoverMutex);
+                if (++_brokerErrors >= _failoverThreshold && !_failoverRequested)
+                {
+                    _failoverRequested = true;
+                    _failoverCondition.notify_one();
+                }
+            }
             break;
         default:
             break;
@@ -1,11 +1,19 @@
 #pragma once
 
 #include <vector>
+#include <deque>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
 #include <mqtt_client.h>
 #include <functional>
 #include "esp_log.h"         
 #include "esp_idf_version.h" // check IDF version
+#include "ESP32MQTTStaticRoutes.h"
+#include "ESP32MQTTTrace.h"
 
 void onMqttConnect(esp_mqtt_client_handle_t client);
 #if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
@@ -28,6 +36,23 @@ void handleMQTT(void *handler_args, esp_event_base_t base, int32_t event_id, voi
 typedef std::function<void(const std::string &message)> MessageReceivedCallback;
 typedef std::function<void(const std::string &topicStr, const std::string &message)> MessageReceivedCallbackWithTopic;
 
+// What a flow controlled subscription does with a message arriving while its queue is full
+enum OverloadPolicy : uint8_t
+{
+    OVERLOAD_DROP,        // Drop the new message
+    OVERLOAD_KEEP_LATEST, // Drop the oldest queued message, queue the new one
+    OVERLOAD_SAMPLE       // Keep every Nth new message in place of the oldest queued one, drop the others
+};
+
+// Outbound publish classes, see publish(PublishPriority, ...). Higher classes are always sent first
+enum PublishPriority : uint8_t
+{
+    PRIORITY_CRITICAL, // Alarms, command replies
+    PRIORITY_NORMAL,
+    PRIORITY_BULK,     // Backlogs, logs, shaped by setBulkRate()
+    PRIORITY_COUNT
+};
+
 class ESP32MQTTClient
 {
 private:
@@ -42,6 +67,7 @@ private:
     const char *_mqttUsername;
     const char *_mqttPassword;
     const char *_mqttClientName;
+    const char *_topicPrefix;
     int _disableMQTTCleanSession;
     char *_mqttLastWillTopic;
     char *_mqttLastWillMessage;
@@ -52,13 +78,104 @@ private:
     int _mqttMaxOutPacketSize;
     char *_mqttUriBuffer;  // Buffer for setURL allocated memory
 
+    struct InboundLane;
     struct TopicSubscriptionRecord
     {
         std::string topic;
         MessageReceivedCallback callback;
         MessageReceivedCallbackWithTopic callbackWithTopic;
+        uint8_t qos;
+        bool acceptDuplicates; // false: QoS>0 redeliveries are filtered when the duplicate filter is on
+        std::shared_ptr<InboundLane> lane; // Set by setFlowControl(), messages are then delivered by the inbound task
     };
     std::vector<TopicSubscriptionRecord> _topicSubscriptionList;
+    std::mutex _subscriptionListMutex; // Adding and removing records, and their qos: other tasks read the filters under it
+
+    // Broker failover, see addBroker()
+    struct BrokerEndpoint
+    {
+        const char *uri;
+        const char *username;
+        const char *password;
+        int32_t connectUs; // Last TCP connect probe, -1 when unreachable
+        int32_t connackUs; // Last CONNECT to CONNACK round trip, -1 until connected once
+    };
+    std::vector<BrokerEndpoint> _brokers;
+    std::size_t _currentBroker;
+    std::size_t _preferredBroker;
+    uint8_t _failoverThreshold;
+    uint32_t _brokerRecheckMs;
+    uint32_t _brokerErrors;        // Consecutive MQTT_EVENT_ERROR on the current broker
+    bool _brokerSwitched;          // Subscriptions are restored on the next connection
+    bool _brokerSwitching;         // switchBroker() is restarting the client, no drastic reset for its disconnection
+    bool _failoverRequested;
+    int64_t _connectStartUs;
+    mutable std::mutex _failoverMutex; // The fields above, the broker probes and the broker part of _mqtt_config once started
+    std::condition_variable _failoverCondition;
+    std::thread _failoverTask;
+    bool _failoverRunning;
+
+    // Minimal subscriptions mode: what the broker was actually asked for
+    struct BrokerSubscription
+    {
+        std::string filter;
+        uint8_t qos;
+        int msgId; // Of the SUBSCRIBE until its SUBACK, -1 once acknowledged
+    };
+    enum SubscriptionEvent : uint8_t
+    {
+        SUBSCRIPTION_ACKED,           // SUBACK of msg_id
+        SUBSCRIPTION_REFUSED,         // SUBACK of msg_id with a failure return code
+        SUBSCRIPTION_SESSION_RESUMED, // SUBACKs of the SUBSCRIBEs in flight will not come
+        SUBSCRIPTION_SESSION_LOST     // The broker has no subscription for us
+    };
+    bool _minimalSubscriptions;
+    std::vector<BrokerSubscription> _brokerSubscriptions;
+    std::mutex _subscriptionMutex; // _brokerSubscriptions, held while calling esp-mqtt: the MQTT task only try_locks it
+    std::mutex _subscriptionEventMutex;
+    std::vector<std::pair<int, SubscriptionEvent>> _subscriptionEvents; // From the MQTT task, applied by the next sync
+    bool _subscriptionSyncPending;
+
+    // Build time subscriptions, see ESP32MQTTStaticRoutes.h
+    struct StaticRouteTable
+    {
+        const ESP32MQTTStaticRoute *routes;
+        std::size_t count;
+        uint8_t qos;
+    };
+    std::vector<StaticRouteTable> _staticRouteTables;
+
+    // QoS>0 duplicate suppression, a ring of recently seen (msg_id, hash) pairs
+    struct ReceivedMessageFingerprint
+    {
+        int msgId;
+        uint32_t hash;
+    };
+    std::vector<ReceivedMessageFingerprint> _duplicateFilterWindow;
+    std::size_t _duplicateFilterNext;
+
+    // Inbound flow control, lanes are shared between the MQTT task and the inbound task
+    std::vector<std::shared_ptr<InboundLane>> _inboundLanes;
+    std::size_t _inboundNextLane;
+    std::mutex _inboundMutex;
+    std::condition_variable _inboundCondition;
+    std::thread _inboundTask;
+    bool _inboundRunning;
+    uint16_t _mqttReceiveMaximum;
+
+    // Outbound priority lanes, drained by the outbound task, see the lanes themselves at the bottom
+    std::vector<std::pair<int, uint8_t>> _outboundInflight; // msg_id, priority of the QoS>0 publishes not acknowledged yet
+    std::vector<int> _outboundEarlyAcks;                    // Unknown acks while _outboundReserved, one of them may be its msg_id
+    bool _outboundReserved;                                 // A QoS>0 lane publish is on its way, its msg_id is not registered yet
+    uint32_t _bulkBytesPerSecond;                           // 0: bulk is not shaped
+    uint32_t _bulkBurstBytes;
+    int64_t _bulkTokens;
+    int64_t _bulkRefillUs;
+    int64_t _bulkCredit;                                    // Byte-microseconds since _bulkRefillUs not worth a whole token yet
+    std::mutex _outboundMutex;
+    std::condition_variable _outboundCondition;
+    std::thread _outboundTask;
+    bool _outboundRunning;
 
     // General behaviour related
     bool _enableSerialLogs;
@@ -67,6 +184,38 @@ private:
 public:
     // Constants
     static constexpr uint16_t DEFAULT_PACKET_SIZE = 1024;
+    static constexpr uint8_t DEFAULT_DUPLICATE_WINDOW = 16;
+    static constexpr uint16_t DEFAULT_TRACE_CAPACITY = 512;
+    static constexpr uint8_t DEFAULT_FAILOVER_THRESHOLD = 3;
+    static constexpr uint32_t DEFAULT_BROKER_RECHECK_MS = 60000;
+    static constexpr uint32_t BROKER_PROBE_TIMEOUT_MS = 3000;
+    static constexpr uint8_t MAX_EARLY_ACKS = 8;
+
+    struct Stats
+    {
+        uint32_t duplicatesDropped; // QoS>0 redeliveries dropped by the duplicate filter, not those an opted-out subscription still received
+        uint32_t inboundDropped;    // Messages dropped by the overload policies of all subscriptions
+        uint32_t brokerSwitches;    // Failovers and migrations back to the preferred broker
+    };
+
+    struct SubscriptionStats
+    {
+        uint32_t delivered;
+        uint32_t dropped;
+        uint16_t queued;
+        uint16_t queueHighWater;
+    };
+
+    struct PublishLaneStats
+    {
+        uint32_t sent;
+        uint32_t dropped;       // Queue full, or rejected by esp-mqtt
+        uint16_t queued;
+        uint16_t queueHighWater;
+        uint8_t inflight;       // QoS>0 publishes waiting for their ack
+        uint32_t avgDelayUs;    // Time spent in the queue
+        uint32_t maxDelayUs;
+    };
 
     ESP32MQTTClient(/* args */);
     ~ESP32MQTTClient();
@@ -79,6 +228,9 @@ public:
 
     void disableAutoReconnect();
     void setTaskPrio(int prio);
+    void enableTracing(const std::size_t capacity = DEFAULT_TRACE_CAPACITY);                     // Record pipeline spans in a ring of capacity entries. Must be called before loopStart()
+    void enableMinimalSubscriptions(const bool enabled = true);                                 // Only subscribe the broker to filters not covered by another subscription. Must be called before subscribing
+    void enableDuplicateFilter(const uint8_t windowSize = DEFAULT_DUPLICATE_WINDOW); // Drop QoS>0 redeliveries (DUP flag) already seen among the last windowSize messages. 0 disables the filter
 
     /// Main loop, to call at each sketch loop()
     //void loop();
@@ -93,11 +245,29 @@ public:
     bool setMaxOutPacketSize(const uint16_t size);
     bool setMaxPacketSize(const uint16_t size); // override the default value of 1024
     bool publish(const std::string &topic, const std::string &payload, int qos = 0, bool retain = false);
+    bool publish(const std::string &topic, const uint8_t *payload, std::size_t length, int qos = 0, bool retain = false); // Binary payloads
+    bool publish(const char *topic, const uint8_t *payload, std::size_t length, int qos = 0, bool retain = false);        // No std::string on the way, see ESP32MQTTTopicTemplate.h
+    bool publish(PublishPriority priority, const std::string &topic, const std::string &payload, int qos = 0, bool retain = false); // Queued, sent by the outbound task. False when the lane is full
+    bool setPublishLane(PublishPriority priority, uint16_t queueDepth, uint8_t inflightBudget); // Queued messages, and QoS>0 publishes waiting for their ack, allowed in the lane
+    void setBulkRate(uint32_t bytesPerSecond, uint32_t burstBytes = 0);                         // Token bucket for the bulk lane, 0 bytesPerSecond: unlimited. burstBytes defaults to one second of traffic
+    bool getPublishLaneStats(PublishPriority priority, PublishLaneStats &stats);
     bool subscribe(const std::string &topic, MessageReceivedCallback messageReceivedCallback, uint8_t qos = 0);
     bool subscribe(const std::string &topic, MessageReceivedCallbackWithTopic messageReceivedCallback, uint8_t qos = 0);
     bool unsubscribe(const std::string &topic);                                       // Unsubscribes from the topic, if it exists, and removes it from the CallbackList.
+    template <std::size_t N>
+    bool subscribeStatic(const ESP32MQTTStaticRoute (&routes)[N], uint8_t qos = 0) { return subscribeStaticRange(routes, N, qos); } // The table must outlive the client, e.g. a static const array
+    bool subscribeStaticRange(const ESP32MQTTStaticRoute *routes, std::size_t count, uint8_t qos = 0);                           // Same for the first count routes of a table known by pointer
+    bool unsubscribeStatic(const ESP32MQTTStaticRoute *routes);
+    bool setFlowControl(const std::string &topic, uint16_t maxRatePerSecond, uint16_t queueDepth,   // Deliver the subscription from the inbound task at most maxRatePerSecond (0: unlimited),
+                        OverloadPolicy policy = OVERLOAD_DROP, uint16_t sampleEvery = 10);         // with up to queueDepth messages waiting. Call after subscribe(): its callback is copied
+                                                                                                   // now, call again after subscribing anew. unsubscribe() removes the flow control
+    bool getSubscriptionStats(const std::string &topic, SubscriptionStats &stats);
+    void setReceiveMaximum(uint16_t receiveMaximum);                                  // MQTT 5 only (IDF >= 5.1 with CONFIG_MQTT_PROTOCOL_5): in-flight QoS>0 messages the broker may send. Must be called before loopStart()
+    bool setDuplicateFilter(const std::string &topic, bool enabled);                  // Per subscription opt-out of the duplicate filter (enabled by default once enableDuplicateFilter() is called)
     void setKeepAlive(uint16_t keepAliveSeconds);                                // Change the keepalive interval (15 seconds by default)
+    void setReconnectTimeout(uint32_t reconnectMs);                              // Wait between reconnection attempts (esp-mqtt default: 10 s). Must be called before loopStart()
     inline void setMqttClientName(const char *name) { _mqttClientName = name; }; // Allow to set client name manually (must be done in setup(), else it will not work.)
+    inline void setTopicPrefix(const char *prefix) { _topicPrefix = prefix; };   // Device prefix of the topic templates, the client name by default
     inline void setURI(const char *uri, const char *username = "", const char *password = "")
     { // Allow setting the MQTT info manually (must be done in setup())
         _mqttUri = uri;
@@ -145,11 +315,32 @@ public:
         _mqttPassword = password;
     };
 
+    // Multi-broker failover. The brokers are probed (TCP connect time) by loopStart(), which connects to the fastest
+    // reachable one: the preferred broker. After setFailoverThreshold() consecutive errors the client moves to the fastest
+    // other reachable broker, and it migrates back once the preferred broker answers probes again.
+    bool addBroker(const char *uri, const char *username = "", const char *password = ""); // Must be called before loopStart()
+    inline void setFailoverThreshold(uint8_t errors) { _failoverThreshold = errors; };
+    inline void setBrokerRecheckInterval(uint32_t ms) { _brokerRecheckMs = ms; }; // How often the preferred broker is probed while on another one
+    int getCurrentBroker() const;
+    int32_t getBrokerConnectTime(std::size_t index) const; // Last probe, us, -1 when unreachable
+    int32_t getBrokerConnackTime(std::size_t index) const; // Last CONNECT to CONNACK, us, -1 when never connected
+
     inline bool isConnected() const { return _mqttConnected; };    
     inline bool isMyTurn(esp_mqtt_client_handle_t client) const { return _mqtt_client==client; }; // Return true if mqtt is connected
 
     inline const char *getClientName() { return _mqttClientName; };
     inline const char *getURI() { return _mqttUri; };
+    inline const char *getTopicPrefix() const { return _topicPrefix ? _topicPrefix : (_mqttClientName ? _mqttClientName : ""); };
+    inline int getMaxOutPacketSize() const { return _mqttMaxOutPacketSize; };
+
+    Stats getStats() const; // A copy, the counters are updated by the MQTT, inbound and failover tasks
+
+    // Chrome trace-event JSON export of the recorded spans, see enableTracing()
+    std::size_t exportTrace(TraceWriter writer) const { return _trace.exportJson(writer); };
+    bool exportTraceToFile(const char *path) const; // Host harness or VFS mounted storage
+    void printTrace() const;                        // To stdout, i.e. serial
+    bool publishTrace(const std::string &topic);
+    inline void clearTrace() { _trace.clear(); };
 
     void printError(esp_mqtt_error_codes_t *error_handle);
     
@@ -169,9 +360,68 @@ private:
     void setConfigCaCert(const char *cert);
     void setConfigClientKey(const char *key);
     void setConfigKeepAlive(uint16_t seconds);
+    void setConfigReconnectTimeout(uint32_t reconnectMs);
     void setConfigLwt(const char *topic, const char *msg, int qos, bool retain);
     void setConfigSessionSettings();
+    void setConfigReceiveMaximum();
+    esp_err_t setConnectPropertyReceiveMaximum();
+
+    struct StatsCounters
+    {
+        std::atomic<uint32_t> duplicatesDropped;
+        std::atomic<uint32_t> inboundDropped;
+        std::atomic<uint32_t> brokerSwitches;
+    } _stats;
+    ESP32MQTTTrace _trace;
+
+    struct InboundLane
+    {
+        MessageReceivedCallback callback;
+        MessageReceivedCallbackWithTopic callbackWithTopic;
+        uint32_t minIntervalUs; // 0: no rate limit
+        uint16_t queueDepth;
+        OverloadPolicy policy;
+        uint16_t sampleEvery;
+        uint32_t overloadCount;
+        int64_t nextDeliveryUs;
+        std::deque<std::pair<std::string, std::string>> queue; // topic, payload
+        SubscriptionStats stats;
+    };
+
+    struct OutboundMessage
+    {
+        std::string topic;
+        std::string payload;
+        int qos;
+        bool retain;
+        int64_t enqueuedUs;
+    };
+
+    struct OutboundLane
+    {
+        std::deque<OutboundMessage> queue;
+        uint16_t queueDepth;
+        uint8_t inflightBudget;
+        uint64_t totalDelayUs;
+        PublishLaneStats stats;
+    };
+    OutboundLane _outboundLanes[PRIORITY_COUNT];
 
-    void onMessageReceivedCallback(const char *topic, char *payload, unsigned int length);
+    bool isDuplicateMessage(esp_mqtt_event_handle_t event);
+    void startTask(std::thread &task, const char *name, void (ESP32MQTTClient::*loop)());
+    std::vector<std::pair<std::string, uint8_t>> subscriptionFilters();
+    bool syncSubscriptionCover();
+    bool updateSubscriptionCover(const std::vector<std::pair<int, SubscriptionEvent>> &events);
+    void postSubscriptionEvent(int msgId, SubscriptionEvent event);
+    void restoreSubscriptions();
+    void probeBrokers();
+    void switchBroker(std::size_t index);
+    void failoverTaskLoop();
+    void enqueueInbound(InboundLane &lane, const std::string &topic, const std::string &payload);
+    void inboundTaskLoop();
+    void releaseOutboundInflight(int msgId);
+    void outboundTaskLoop();
+    void dispatchStaticRoutes(const char *topic, std::size_t topicLen, const char *payload, std::size_t length);
+    void onMessageReceivedCallback(const char *topic, char *payload, unsigned int length, bool duplicate = false, int msgId = -1);
     bool mqttTopicMatch(const std::string &topic1, const std::string &topic2);
 };
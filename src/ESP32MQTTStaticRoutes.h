@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+/*
+ * Compile-time topic filters and static dispatch tables.
+ *
+ * Topic filters that are known at build time can be declared with MQTT_STATIC_ROUTE(). The filter
+ * is validated by the compiler ('#' only as the last level, '+' only as a whole level), its length
+ * and level count are computed at compile time, and the handler is a plain function pointer.
+ * Matching walks the literal and the received topic level by level in place: no std::string, no
+ * substr, no heap.
+ *
+ *     static void onTemperature(const char *topic, size_t topicLen, const char *payload, size_t length);
+ *     static const ESP32MQTTStaticRoute routes[] = {
+ *         MQTT_STATIC_ROUTE("plant/+/temperature", onTemperature),
+ *         MQTT_STATIC_ROUTE("plant/alarm/#", onAlarm),
+ *     };
+ *     mqttClient.subscribeStatic(routes, 1); // in onMqttConnect()
+ */
+
+typedef void (*StaticMessageHandler)(const char *topic, std::size_t topicLen, const char *payload, std::size_t length);
+
+/**
+ * Validate an MQTT topic filter at compile time (C++11 constexpr, hence the recursion)
+ *
+ * @param filter is the topic filter
+ * @param i is the current position, used by the recursion
+ * @param prev is the previous character, '/' at the start of the filter
+ * @return true if the filter is not empty and every wildcard is well placed
+ */
+constexpr bool mqttTopicFilterValid(const char *filter, std::size_t i = 0, char prev = '/')
+{
+    return filter[i] == '\0'  ? i > 0
+           : filter[i] == '#' ? (prev == '/' && filter[i + 1] == '\0')
+           : filter[i] == '+' ? (prev == '/' && (filter[i + 1] == '/' || filter[i + 1] == '\0') && mqttTopicFilterValid(filter, i + 1, '+'))
+                              : mqttTopicFilterValid(filter, i + 1, filter[i]);
+}
+
+constexpr std::size_t mqttTopicLevelCount(const char *filter, std::size_t i = 0)
+{
+    return filter[i] == '\0' ? 1 : (filter[i] == '/' ? 1 : 0) + mqttTopicLevelCount(filter, i + 1);
+}
+
+constexpr bool mqttTopicFilterHasChar(const char *filter, char c, std::size_t i = 0)
+{
+    return filter[i] != '\0' && (filter[i] == c || mqttTopicFilterHasChar(filter, c, i + 1));
+}
+
+/**
+ * Match a received topic against a validated topic filter, level by level, without copying
+ *
+ * @param filter is a valid topic filter, see mqttTopicFilterValid()
+ * @param topic is the received topic, not null terminated
+ * @param topicLen is the length of the received topic
+ * @return true on MQTT topic match, false otherwise
+ */
+inline bool mqttStaticTopicMatch(const char *filter, const char *topic, std::size_t topicLen)
+{
+    // Topics starting with '$' are not matched by a leading wildcard
+    if (topicLen > 0 && topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+        return false;
+
+    std::size_t j = 0;
+    for (const char *f = filter; *f != '\0'; f++)
+    {
+        if (*f == '#')
+            return true;
+
+        if (*f == '+')
+        {
+            while (j < topicLen && topic[j] != '/')
+                j++;
+            continue;
+        }
+
+        if (j == topicLen)
+            // "a/#" also matches its parent level "a"
+            return f[0] == '/' && f[1] == '#';
+
+        if (*f != topic[j])
+            return false;
+        j++;
+    }
+
+    return j == topicLen;
+}
+
+struct ESP32MQTTStaticRoute
+{
+    const char *filter;
+    std::size_t filterLen;
+    std::size_t levels;
+    bool singleLevelWildcard;
+    bool multiLevelWildcard;
+    StaticMessageHandler handler;
+
+    template <bool Valid, std::size_t N>
+    static constexpr ESP32MQTTStaticRoute make(const char (&filter)[N], StaticMessageHandler handler)
+    {
+        static_assert(Valid, "Invalid MQTT topic filter: '#' must be the last level and '+' must be a whole level");
+        return ESP32MQTTStaticRoute{filter, N - 1, mqttTopicLevelCount(filter),
+                                    mqttTopicFilterHasChar(filter, '+'), mqttTopicFilterHasChar(filter, '#'), handler};
+    }
+
+    /**
+     * @param topicLevels is the level count of the topic, computed once per message by the caller
+     */
+    inline bool matches(const char *topic, std::size_t topicLen, std::size_t topicLevels) const
+    {
+        if (multiLevelWildcard)
+        {
+            if (topicLevels + 1 < levels)
+                return false;
+        }
+        else
+        {
+            if (topicLevels != levels)
+                return false;
+            if (!singleLevelWildcard)
+                return topicLen == filterLen && memcmp(filter, topic, topicLen) == 0;
+        }
+        return mqttStaticTopicMatch(filter, topic, topicLen);
+    }
+};
+
+#define MQTT_STATIC_ROUTE(filter, handler) ESP32MQTTStaticRoute::make<mqttTopicFilterValid(filter)>(filter, handler)
@@ -0,0 +1,459 @@
+#include "ESP32MQTTTelemetry.h"
+#include <cmath>
+#include <cstring>
+#include "esp_timer.h"
+
+static const char *TAG = "ESP32MQTTTelemetry";
+
+// Worst case encoded sizes
+static constexpr std::size_t VARINT_BOUND = 10;      // 64 bits
+static constexpr std::size_t GORILLA_VALUE_BOUND = 6; // '11' + 5 + 5 + 32 bits
+static constexpr std::size_t COLUMN_LENGTH_BOUND = 3; // Varint of a column length, below 2 MB
+
+static inline uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint8_t *putVarint(uint8_t *out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static inline uint32_t floatBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline float bitsFloat(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline void put32le(uint8_t *out, uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+static inline uint32_t get32le(const uint8_t *in)
+{
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+// ================== ESP32MQTTTelemetryBatch ====================
+
+ESP32MQTTTelemetryBatch::ESP32MQTTTelemetryBatch(ESP32MQTTClient &client, const char *topic, uint8_t channels, TelemetryEncoding encoding,
+                                                 uint32_t maxAgeMs, std::size_t maxBytes)
+    : _client(client), _topic(topic), _limit(0), _headerBound(0), _sampleBound(0), _count(0), _firstUs(0), _maxAgeMs(maxAgeMs),
+      _scale(1), _qos(0), _channels(channels), _encoding(encoding)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    if (channels == 0 || channels > MAX_CHANNELS || encoding > TELEMETRY_GORILLA)
+    {
+        ESP_LOGE(TAG, "Invalid telemetry batch: %u channels, encoding %u", channels, encoding);
+        return;
+    }
+
+    // Output buffer minus fixed header (up to 5 bytes), topic length, topic, packet id and MQTT 5 property length
+    int available = _client.getMaxOutPacketSize() - 5 - 2 - (int)_topic.size() - 2 - 1;
+    if (maxBytes > 0 && (int)maxBytes < available)
+        available = maxBytes;
+
+    std::size_t valueBound = encoding == TELEMETRY_FLOAT32 ? 4 : encoding == TELEMETRY_VARINT ? VARINT_BOUND : GORILLA_VALUE_BOUND;
+    _headerBound = 3 + 5 + 4 + (channels + 1) * COLUMN_LENGTH_BOUND; // Version, encoding, channels, count, scale, column lengths
+    _sampleBound = VARINT_BOUND + channels * valueBound;
+    if (available < (int)(_headerBound + _sampleBound))
+    {
+        ESP_LOGE(TAG, "Output buffer too small for a telemetry batch, see setMaxPacketSize()");
+        return;
+    }
+
+    _limit = available;
+    _payload.resize(_limit);
+    for (std::size_t i = 0; i <= _channels; i++)
+        _columns[i].data.resize(_limit - _headerBound);
+    resetColumns();
+}
+
+void ESP32MQTTTelemetryBatch::setScale(float scale)
+{
+    flush();
+    _scale = scale > 0 ? scale : 1;
+}
+
+bool ESP32MQTTTelemetryBatch::add(float value)
+{
+    if (_channels != 1)
+        return false;
+    return add(esp_timer_get_time() / 1000, &value);
+}
+
+bool ESP32MQTTTelemetryBatch::add(int64_t timestampMs, const float *values)
+{
+    if (_limit == 0)
+        return false;
+
+    // Publish first if this sample might not fit
+    bool ok = true;
+    if (_count > 0 && _headerBound + columnBytes() + _sampleBound > _limit)
+        ok = flush();
+
+    Column &timestamps = _columns[0];
+    if (_count == 0)
+    {
+        putVarint(timestamps, zigzag(timestampMs));
+        _firstUs = esp_timer_get_time();
+    }
+    else
+    {
+        int64_t delta = timestampMs - timestamps.previous;
+        putVarint(timestamps, zigzag(delta - timestamps.previousDelta));
+        timestamps.previousDelta = delta;
+    }
+    timestamps.previous = timestampMs;
+
+    for (std::size_t i = 0; i < _channels; i++)
+        encodeValue(_columns[i + 1], values[i]);
+    _count++;
+
+    return poll() && ok;
+}
+
+bool ESP32MQTTTelemetryBatch::poll()
+{
+    if (_count > 0 && _maxAgeMs > 0 && esp_timer_get_time() - _firstUs >= (int64_t)_maxAgeMs * 1000)
+        return flush();
+    return true;
+}
+
+bool ESP32MQTTTelemetryBatch::flush()
+{
+    if (_count == 0)
+        return true;
+
+    uint8_t *out = _payload.data();
+    *out++ = FORMAT_VERSION;
+    *out++ = _encoding;
+    *out++ = _channels;
+    out = ::putVarint(out, _count);
+    if (_encoding == TELEMETRY_VARINT)
+    {
+        put32le(out, floatBits(_scale));
+        out += 4;
+    }
+    for (std::size_t i = 0; i <= _channels; i++)
+        out = ::putVarint(out, (_columns[i].bits + 7) / 8);
+    for (std::size_t i = 0; i <= _channels; i++)
+    {
+        std::size_t bytes = (_columns[i].bits + 7) / 8;
+        memcpy(out, _columns[i].data.data(), bytes);
+        out += bytes;
+    }
+
+    std::size_t length = out - _payload.data();
+    bool published = _client.publish(_topic.c_str(), _payload.data(), length, _qos, false);
+    if (published)
+    {
+        _stats.batches++;
+        _stats.samples += _count;
+        _stats.payloadBytes += length;
+    }
+    else
+    {
+        _stats.failedBatches++;
+    }
+    resetColumns();
+    return published;
+}
+
+std::size_t ESP32MQTTTelemetryBatch::columnBytes() const
+{
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i <= _channels; i++)
+        bytes += (_columns[i].bits + 7) / 8;
+    return bytes;
+}
+
+void ESP32MQTTTelemetryBatch::resetColumns()
+{
+    for (std::size_t i = 0; i <= _channels; i++)
+    {
+        _columns[i].bits = 0;
+        _columns[i].previous = 0;
+        _columns[i].previousDelta = 0;
+        _columns[i].leading = 0xFF;
+        _columns[i].trailing = 0;
+    }
+    _count = 0;
+}
+
+void ESP32MQTTTelemetryBatch::encodeValue(Column &column, float value)
+{
+    switch (_encoding)
+    {
+    case TELEMETRY_FLOAT32:
+        put32le(&column.data[column.bits / 8], floatBits(value));
+        column.bits += 32;
+        break;
+
+    case TELEMETRY_VARINT:
+    {
+        // Clamped to +/-2^62 so the deltas cannot overflow, NaN as 0
+        float scaled = value * _scale;
+        if (scaled != scaled)
+            scaled = 0;
+        else if (scaled > 4.6e18f)
+            scaled = 4.6e18f;
+        else if (scaled < -4.6e18f)
+            scaled = -4.6e18f;
+        int64_t integer = std::llround(scaled);
+        putVarint(column, zigzag(_count == 0 ? integer : integer - column.previous));
+        column.previous = integer;
+        break;
+    }
+
+    case TELEMETRY_GORILLA:
+    {
+        uint32_t bits = floatBits(value);
+        uint32_t xored = bits ^ (uint32_t)column.previous;
+        if (_count == 0)
+        {
+            putBits(column, bits, 32);
+        }
+        else if (xored == 0)
+        {
+            putBits(column, 0, 1);
+        }
+        else
+        {
+            uint8_t leading = __builtin_clz(xored);
+            uint8_t trailing = __builtin_ctz(xored);
+            if (column.leading != 0xFF && leading >= column.leading && trailing >= column.trailing)
+            {
+                // Same window as before, only its bits
+                putBits(column, 2, 2);
+                putBits(column, xored >> column.trailing, 32 - column.leading - column.trailing);
+            }
+            else
+            {
+                uint8_t length = 32 - leading - trailing;
+                putBits(column, 3, 2);
+                putBits(column, leading, 5);
+                putBits(column, length - 1, 5);
+                putBits(column, xored >> trailing, length);
+                column.leading = leading;
+                column.trailing = trailing;
+            }
+        }
+        column.previous = bits;
+        break;
+    }
+    }
+}
+
+void ESP32MQTTTelemetryBatch::putBits(Column &column, uint64_t value, unsigned count)
+{
+    while (count > 0)
+    {
+        uint8_t &byte = column.data[column.bits / 8];
+        unsigned room = 8 - column.bits % 8;
+        unsigned take = count < room ? count : room;
+        if (room == 8)
+            byte = 0;
+        byte |= ((value >> (count - take)) & ((1u << take) - 1)) << (room - take);
+        column.bits += take;
+        count -= take;
+    }
+}
+
+void ESP32MQTTTelemetryBatch::putVarint(Column &column, uint64_t value)
+{
+    uint8_t *start = &column.data[column.bits / 8];
+    column.bits += (::putVarint(start, value) - start) * 8;
+}
+
+// ================== ESP32MQTTTelemetryReader ====================
+
+ESP32MQTTTelemetryReader::ESP32MQTTTelemetryReader(const uint8_t *payload, std::size_t length)
+    : _count(0), _index(0), _scale(1), _channels(0), _encoding(TELEMETRY_FLOAT32), _valid(false)
+{
+    if (length < 3 || payload[0] != ESP32MQTTTelemetryBatch::FORMAT_VERSION || payload[1] > TELEMETRY_GORILLA ||
+        payload[2] == 0 || payload[2] > ESP32MQTTTelemetryBatch::MAX_CHANNELS)
+        return;
+    _encoding = (TelemetryEncoding)payload[1];
+    _channels = payload[2];
+
+    // The header is read as one more column
+    Column header = {payload, length, 3 * 8, 0, 0, 0xFF, 0};
+    uint64_t count;
+    if (!readVarint(header, count) || count > UINT32_MAX)
+        return;
+    if (_encoding == TELEMETRY_VARINT)
+    {
+        if (header.bit / 8 + 4 > length)
+            return;
+        _scale = bitsFloat(get32le(payload + header.bit / 8));
+        header.bit += 32;
+        if (!(_scale > 0))
+            return;
+    }
+
+    uint64_t lengths[ESP32MQTTTelemetryBatch::MAX_CHANNELS + 1];
+    for (std::size_t i = 0; i <= _channels; i++)
+    {
+        if (!readVarint(header, lengths[i]))
+            return;
+    }
+    std::size_t offset = header.bit / 8;
+    for (std::size_t i = 0; i <= _channels; i++)
+    {
+        if (lengths[i] > length - offset)
+            return;
+        _columns[i] = {payload + offset, (std::size_t)lengths[i], 0, 0, 0, 0xFF, 0};
+        offset += lengths[i];
+    }
+    _count = count;
+    _valid = offset == length;
+}
+
+bool ESP32MQTTTelemetryReader::next(int64_t &timestampMs, float *values)
+{
+    if (!_valid || _index == _count)
+        return false;
+
+    Column &timestamps = _columns[0];
+    uint64_t raw;
+    if (!readVarint(timestamps, raw))
+        return false;
+    if (_index == 0)
+    {
+        timestamps.previous = unzigzag(raw);
+    }
+    else
+    {
+        // Wrapping arithmetic, a malformed payload must not overflow
+        timestamps.previousDelta = (int64_t)((uint64_t)timestamps.previousDelta + (uint64_t)unzigzag(raw));
+        timestamps.previous = (int64_t)((uint64_t)timestamps.previous + (uint64_t)timestamps.previousDelta);
+    }
+
+    for (std::size_t i = 0; i < _channels; i++)
+        values[i] = decodeValue(_columns[i + 1]);
+    if (!_valid)
+        return false;
+
+    timestampMs = timestamps.previous;
+    _index++;
+    return true;
+}
+
+float ESP32MQTTTelemetryReader::decodeValue(Column &column)
+{
+    switch (_encoding)
+    {
+    case TELEMETRY_FLOAT32:
+        if (column.bit / 8 + 4 > column.length)
+        {
+            _valid = false;
+            return 0;
+        }
+        column.bit += 32;
+        return bitsFloat(get32le(column.data + column.bit / 8 - 4));
+
+    case TELEMETRY_VARINT:
+    {
+        uint64_t raw;
+        if (!readVarint(column, raw))
+            return 0;
+        column.previous = _index == 0 ? unzigzag(raw) : (int64_t)((uint64_t)column.previous + (uint64_t)unzigzag(raw));
+        return column.previous / _scale;
+    }
+
+    case TELEMETRY_GORILLA:
+    {
+        uint32_t bits = (uint32_t)column.previous;
+        if (_index == 0)
+        {
+            bits = readBits(column, 32);
+        }
+        else if (readBits(column, 1) == 1)
+        {
+            if (readBits(column, 1) == 1)
+            {
+                uint8_t leading = readBits(column, 5);
+                uint8_t length = readBits(column, 5) + 1;
+                if (leading + length > 32)
+                {
+                    _valid = false;
+                    return 0;
+                }
+                column.leading = leading;
+                column.trailing = 32 - leading - length;
+            }
+            else if (column.leading == 0xFF)
+            {
+                _valid = false; // No window yet
+                return 0;
+            }
+            bits ^= (uint32_t)readBits(column, 32 - column.leading - column.trailing) << column.trailing;
+        }
+        column.previous = bits;
+        return bitsFloat(bits);
+    }
+    }
+    return 0;
+}
+
+uint64_t ESP32MQTTTelemetryReader::readBits(Column &column, unsigned count)
+{
+    if (column.bit + count > column.length * 8)
+    {
+        _valid = false;
+        column.bit = column.length * 8;
+        return 0;
+    }
+    uint64_t value = 0;
+    while (count > 0)
+    {
+        unsigned room = 8 - column.bit % 8;
+        unsigned take = count < room ? count : room;
+        value = value << take | ((column.data[column.bit / 8] >> (room - take)) & ((1u << take) - 1));
+        column.bit += take;
+        count -= take;
+    }
+    return value;
+}
+
+bool ESP32MQTTTelemetryReader::readVarint(Column &column, uint64_t &value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (column.bit / 8 >= column.length)
+            break;
+        uint8_t byte = column.data[column.bit / 8];
+        column.bit += 8;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    _valid = false;
+    return false;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "ESP32MQTTClient.h"
+
+/*
+ * Batched telemetry: numeric samples of a topic packed into one columnar payload instead of one
+ * MQTT packet per sample.
+ *
+ * ESP32MQTTTelemetryBatch collects samples (a timestamp and one value per channel) and publishes
+ * the batch when the next sample might not fit the client output buffer, or when the oldest sample
+ * is older than maxAgeMs. Column buffers are sized once from getMaxOutPacketSize(), so adding
+ * samples and publishing does not touch the heap. ESP32MQTTTelemetryReader decodes a batch on the
+ * subscriber side, sample by sample, in place.
+ *
+ *     ESP32MQTTTelemetryBatch vibration(mqttClient, "devices/esp32/vibration", 3);       // x, y, z
+ *     float xyz[3] = {ax, ay, az};
+ *     vibration.add(esp_timer_get_time() / 1000, xyz);
+ *
+ *     ESP32MQTTTelemetryReader reader(payload);
+ *     while (reader.next(timestampMs, xyz)) ...
+ *
+ * Payload, little endian:
+ *   u8 format version, u8 encoding, u8 channels, varint sample count, f32 scale (TELEMETRY_VARINT only),
+ *   varint byte length of each column (timestamps first, then one per channel), then the columns:
+ *   timestamps         zig-zag varints: first timestamp (ms), then delta of delta (0 for a steady rate)
+ *   TELEMETRY_FLOAT32  f32 per sample
+ *   TELEMETRY_VARINT   zig-zag varints: first round(value * scale), then deltas
+ *   TELEMETRY_GORILLA  bit stream, MSB first: first value on 32 bits, then the XOR with the previous value:
+ *                      '0' when equal, '10' + the meaningful bits when they fit the previous leading /
+ *                      trailing zeros window, else '11' + 5 bits leading zeros + 5 bits length - 1 + the bits
+ *
+ * Not thread safe: add(), poll() and flush() of a batch are meant to be called from one task.
+ */
+
+enum TelemetryEncoding : uint8_t
+{
+    TELEMETRY_FLOAT32, // 4 bytes per value
+    TELEMETRY_VARINT,  // Values scaled to integers, exact for integer samples (counters, ADC readings)
+    TELEMETRY_GORILLA  // Lossless, 1 bit for a repeated value, a few bits for slowly changing ones
+};
+
+class ESP32MQTTTelemetryBatch
+{
+public:
+    static constexpr uint8_t MAX_CHANNELS = 8;
+    static constexpr uint8_t FORMAT_VERSION = 1;
+
+    struct Stats
+    {
+        uint32_t batches;       // Published
+        uint32_t samples;       // In the published batches
+        uint32_t payloadBytes;  // Of the published batches
+        uint32_t failedBatches; // Publish refused, their samples are lost
+    };
+
+    // Construct after setMaxPacketSize(). maxBytes caps the payload below what the output buffer allows, 0: no cap
+    ESP32MQTTTelemetryBatch(ESP32MQTTClient &client, const char *topic, uint8_t channels = 1, TelemetryEncoding encoding = TELEMETRY_GORILLA,
+                            uint32_t maxAgeMs = 1000, std::size_t maxBytes = 0);
+
+    inline bool isValid() const { return _limit > 0; };
+    inline void setQos(int qos) { _qos = qos; };
+    void setScale(float scale); // TELEMETRY_VARINT: values are rounded to 1 / scale (100: two decimals). Flushes the pending samples
+
+    bool add(int64_t timestampMs, const float *values); // One value per channel. False when a flush it triggered failed
+    inline bool add(int64_t timestampMs, float value) { return add(timestampMs, &value); };
+    bool add(float value); // Single channel, timestamped now
+    bool poll();           // Flush when the oldest sample is older than maxAgeMs. Call it regularly if samples may stop coming
+    bool flush();          // Publish the pending samples now, true when there were none
+
+    inline uint32_t pending() const { return _count; };
+    inline std::size_t payloadLimit() const { return _limit; };
+    inline const Stats &getStats() const { return _stats; };
+
+private:
+    struct Column
+    {
+        std::vector<uint8_t> data; // Sized once, never reallocated
+        std::size_t bits;
+        int64_t previous;      // Timestamp, scaled value or float bits of the last sample
+        int64_t previousDelta; // Timestamps only
+        uint8_t leading;       // Gorilla window, 0xFF before the first XOR
+        uint8_t trailing;
+    };
+
+    ESP32MQTTClient &_client;
+    std::string _topic;
+    std::vector<uint8_t> _payload;
+    Column _columns[MAX_CHANNELS + 1]; // Timestamps, then one per channel
+    std::size_t _limit;
+    std::size_t _headerBound; // Worst case header size
+    std::size_t _sampleBound; // Worst case growth of the columns per sample
+    uint32_t _count;
+    int64_t _firstUs; // Arrival of the oldest pending sample
+    uint32_t _maxAgeMs;
+    float _scale;
+    int _qos;
+    uint8_t _channels;
+    TelemetryEncoding _encoding;
+    Stats _stats;
+
+    std::size_t columnBytes() const;
+    void resetColumns();
+    void encodeValue(Column &column, float value);
+    static void putBits(Column &column, uint64_t value, unsigned count);
+    static void putVarint(Column &column, uint64_t value);
+};
+
+class ESP32MQTTTelemetryReader
+{
+public:
+    ESP32MQTTTelemetryReader(const uint8_t *payload, std::size_t length);
+    inline ESP32MQTTTelemetryReader(const std::string &payload)
+        : ESP32MQTTTelemetryReader(reinterpret_cast<const uint8_t *>(payload.data()), payload.size()) {}
+
+    inline bool isValid() const { return _valid; }; // False on a malformed payload, also once next() met one
+    inline uint8_t channels() const { return _channels; };
+    inline TelemetryEncoding encoding() const { return _encoding; };
+    inline uint32_t sampleCount() const { return _count; };
+
+    bool next(int64_t &timestampMs, float *values); // values holds channels() entries. False at the end or on a malformed payload
+
+private:
+    struct Column
+    {
+        const uint8_t *data;
+        std::size_t length; // Bytes
+        std::size_t bit;    // Read position
+        int64_t previous;
+        int64_t previousDelta;
+        uint8_t leading;
+        uint8_t trailing;
+    };
+
+    Column _columns[ESP32MQTTTelemetryBatch::MAX_CHANNELS + 1];
+    uint32_t _count;
+    uint32_t _index;
+    float _scale;
+    uint8_t _channels;
+    TelemetryEncoding _encoding;
+    bool _valid;
+
+    float decodeValue(Column &column);
+    uint64_t readBits(Column &column, unsigned count);
+    bool readVarint(Column &column, uint64_t &value);
+};
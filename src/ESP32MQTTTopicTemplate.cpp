@@ -0,0 +1,134 @@
+#include "ESP32MQTTTopicTemplate.h"
+#include <stdio.h>
+
+ESP32MQTTTopicTemplate::ESP32MQTTTopicTemplate(const char *prefix, const char *pattern, std::size_t capacity)
+    : _length(0), _segmentCount(0), _valid(true)
+{
+    if (prefix != nullptr && prefix[0] != '\0')
+    {
+        _filter = prefix;
+        if (pattern[0] != '\0')
+            _filter += '/';
+    }
+    _filter += pattern;
+
+    // The buffer holds the topic with empty variable segments, and keeps its size for good
+    _buffer.assign(capacity, '\0');
+    for (std::size_t i = 0; i < _filter.size() && _valid; i++)
+    {
+        bool levelStart = i == 0 || _filter[i - 1] == '/';
+        bool levelEnd = i + 1 == _filter.size() || _filter[i + 1] == '/';
+        if (_filter[i] == '#' || (_filter[i] == '+' && !(levelStart && levelEnd)))
+        {
+            _valid = false;
+        }
+        else if (_filter[i] == '+')
+        {
+            if (_segmentCount == MAX_SEGMENTS)
+                _valid = false;
+            else
+            {
+                _offsets[_segmentCount] = _length;
+                _lengths[_segmentCount] = 0;
+                _segmentCount++;
+            }
+        }
+        else if (_length + 1 < capacity)
+        {
+            _buffer[_length++] = _filter[i];
+        }
+        else
+        {
+            _valid = false;
+        }
+    }
+
+    if (!_valid)
+    {
+        _length = 0;
+        _segmentCount = 0;
+    }
+    _buffer[_length] = '\0';
+}
+
+bool ESP32MQTTTopicTemplate::set(std::size_t segment, const char *value, std::size_t length)
+{
+    if (segment >= _segmentCount)
+        return false;
+    for (std::size_t i = 0; i < length; i++)
+    {
+        if (value[i] == '/' || value[i] == '+' || value[i] == '#' || value[i] == '\0')
+            return false;
+    }
+
+    std::size_t oldLength = _lengths[segment];
+    if (_length - oldLength + length + 1 > _buffer.size())
+        return false;
+
+    // Move what follows the segment, then write it
+    char *data = &_buffer[0];
+    std::size_t tail = _offsets[segment] + oldLength;
+    memmove(data + _offsets[segment] + length, data + tail, _length - tail + 1);
+    memcpy(data + _offsets[segment], value, length);
+
+    _length = _length - oldLength + length;
+    _lengths[segment] = length;
+    for (std::size_t i = segment + 1; i < _segmentCount; i++)
+        _offsets[i] = _offsets[i] - oldLength + length;
+
+    return true;
+}
+
+bool ESP32MQTTTopicTemplate::set(std::size_t segment, long long value)
+{
+    char digits[24];
+    int length = snprintf(digits, sizeof(digits), "%lld", value);
+    return set(segment, digits, length);
+}
+
+bool ESP32MQTTTopicTemplate::set(std::size_t segment, unsigned long long value)
+{
+    char digits[24];
+    int length = snprintf(digits, sizeof(digits), "%llu", value);
+    return set(segment, digits, length);
+}
+
+bool ESP32MQTTTopicTemplate::publish(ESP32MQTTClient &client, const uint8_t *payload, std::size_t length, int qos, bool retain) const
+{
+    // Every segment must have been filled, an empty level would publish to another topic
+    for (std::size_t i = 0; i < _segmentCount; i++)
+    {
+        if (_lengths[i] == 0)
+            return false;
+    }
+
+    return _valid && client.publish(c_str(), payload, length, qos, retain);
+}
+
+bool ESP32MQTTTopicTemplate::parse(const char *topic, std::size_t topicLen, Segment *segments) const
+{
+    if (!_valid)
+        return false;
+
+    // Same walk as mqttStaticTopicMatch(), recording where each '+' level lands in the topic
+    std::size_t j = 0;
+    std::size_t segment = 0;
+    for (std::size_t i = 0; i < _filter.size(); i++)
+    {
+        if (_filter[i] == '+')
+        {
+            segments[segment].offset = j;
+            while (j < topicLen && topic[j] != '/')
+                j++;
+            segments[segment].length = j - segments[segment].offset;
+            segment++;
+            continue;
+        }
+
+        if (j == topicLen || _filter[i] != topic[j])
+            return false;
+        j++;
+    }
+
+    return j == topicLen;
+}
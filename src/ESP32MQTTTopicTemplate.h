@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "ESP32MQTTClient.h"
+
+/*
+ * Topic templates: a device prefix and fixed levels formatted once, variable levels filled in place.
+ *
+ * Every '+' level of the pattern is a variable segment. The constructor writes the prefix and the
+ * fixed levels into a buffer of fixed capacity; set() and format() then only rewrite the variable
+ * segments (moving the tail of the topic when their length changes), so building a topic and
+ * publishing it does not touch the heap.
+ *
+ * The same template is also a subscription filter (the '+' levels are MQTT wildcards), and parse()
+ * locates the variable segments of a received topic as offsets into it, without copying.
+ *
+ *     ESP32MQTTTopicTemplate metric(mqttClient.getTopicPrefix(), "+/+");     // "<prefix>/+/+"
+ *     metric.format("line1", "temperature");                                // "<prefix>/line1/temperature"
+ *     metric.publish(mqttClient, payload, length);
+ *
+ *     ESP32MQTTTopicTemplate::Segment segments[ESP32MQTTTopicTemplate::MAX_SEGMENTS];
+ *     if (metric.parse(topic, topicLen, segments))                          // segments[1]: "temperature"
+ */
+class ESP32MQTTTopicTemplate
+{
+public:
+    static constexpr uint8_t MAX_SEGMENTS = 8;
+    static constexpr uint16_t DEFAULT_CAPACITY = 128;
+
+    struct Segment
+    {
+        uint16_t offset; // In the received topic
+        uint16_t length;
+    };
+
+    // prefix may be null or empty, pattern must not start with '/' nor contain '#'
+    ESP32MQTTTopicTemplate(const char *prefix, const char *pattern, std::size_t capacity = DEFAULT_CAPACITY);
+
+    inline bool isValid() const { return _valid; };
+    inline std::size_t segmentCount() const { return _segmentCount; };
+    inline const std::string &filter() const { return _filter; }; // Pass it to subscribe()
+
+    // False when the value does not fit, or is not a plain topic level ('/', '+', '#' or NUL in it)
+    bool set(std::size_t segment, const char *value, std::size_t length);
+    inline bool set(std::size_t segment, const char *value) { return set(segment, value, strlen(value)); };
+    inline bool set(std::size_t segment, const std::string &value) { return set(segment, value.data(), value.size()); };
+    bool set(std::size_t segment, long long value);
+    bool set(std::size_t segment, unsigned long long value);
+    inline bool set(std::size_t segment, int value) { return set(segment, (long long)value); };
+    inline bool set(std::size_t segment, long value) { return set(segment, (long long)value); };
+    inline bool set(std::size_t segment, unsigned value) { return set(segment, (unsigned long long)value); };      // size_t on ESP32
+    inline bool set(std::size_t segment, unsigned long value) { return set(segment, (unsigned long long)value); }; // size_t on 64 bit hosts
+
+    // Fill the segments in order, returns the topic or nullptr if a value did not fit
+    template <typename... Values>
+    const char *format(Values... values) { return formatFrom(0, values...) ? c_str() : nullptr; }
+
+    inline const char *c_str() const { return _buffer.data(); };
+    inline std::size_t length() const { return _length; };
+
+    bool publish(ESP32MQTTClient &client, const uint8_t *payload, std::size_t length, int qos = 0, bool retain = false) const;
+    inline bool publish(ESP32MQTTClient &client, const std::string &payload, int qos = 0, bool retain = false) const
+    {
+        return publish(client, reinterpret_cast<const uint8_t *>(payload.data()), payload.size(), qos, retain);
+    }
+
+    bool parse(const char *topic, std::size_t topicLen, Segment *segments) const; // segments holds segmentCount() entries
+    inline bool parse(const std::string &topic, Segment *segments) const { return parse(topic.data(), topic.size(), segments); };
+
+private:
+    std::string _filter;
+    std::string _buffer; // Sized once, never reallocated
+    std::size_t _length;
+    uint16_t _offsets[MAX_SEGMENTS];
+    uint16_t _lengths[MAX_SEGMENTS];
+    uint8_t _segmentCount;
+    bool _valid;
+
+    inline bool formatFrom(std::size_t) { return true; }
+    template <typename Value, typename... Values>
+    bool formatFrom(std::size_t segment, Value value, Values... values)
+    {
+        return set(segment, value) && formatFrom(segment + 1, values...);
+    }
+};
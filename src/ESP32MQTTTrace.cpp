@@ -0,0 +1,91 @@
+#include "ESP32MQTTTrace.h"
+#include <stdio.h>
+#include "esp_timer.h"
+
+void ESP32MQTTTrace::enable(std::size_t capacity)
+{
+    _spans.assign(capacity, Span{nullptr, 0, 0, 0, 0});
+    _next = 0;
+}
+
+void ESP32MQTTTrace::clear()
+{
+    for (std::size_t i = 0; i < _spans.size(); i++)
+        _spans[i].name = nullptr;
+    _next = 0;
+}
+
+void ESP32MQTTTrace::record(const char *name, int64_t start, int64_t end, int msgId, uint8_t lane)
+{
+    if (_spans.empty())
+        return;
+
+    Span &span = _spans[_next.fetch_add(1, std::memory_order_relaxed) % _spans.size()];
+    span.start = start;
+    span.duration = (int32_t)(end - start);
+    span.msgId = msgId;
+    span.lane = lane;
+    span.name = name;
+}
+
+void ESP32MQTTTrace::instant(const char *name, int msgId, uint8_t lane)
+{
+    if (_spans.empty())
+        return;
+
+    int64_t now = esp_timer_get_time();
+    record(name, now, now - 1, msgId, lane);
+}
+
+std::size_t ESP32MQTTTrace::exportJson(TraceWriter writer) const
+{
+    static const char header[] = "{\"displayTimeUnit\":\"us\",\"traceEvents\":[\n";
+    static const char footer[] = "\n]}\n";
+
+    writer(header, sizeof(header) - 1);
+
+    std::size_t exported = 0;
+    if (!_spans.empty())
+    {
+        // Oldest span first once the ring has wrapped
+        uint32_t next = _next.load(std::memory_order_relaxed);
+        std::size_t count = next < _spans.size() ? next : _spans.size();
+        std::size_t first = next < _spans.size() ? 0 : next % _spans.size();
+
+        char line[160];
+        for (std::size_t i = 0; i < count; i++)
+        {
+            const Span &span = _spans[(first + i) % _spans.size()];
+            if (span.name == nullptr)
+                continue;
+
+            int len;
+            if (span.duration < 0)
+                len = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"msg_id\":%ld}}",
+                               exported ? ",\n" : "", span.name, (long long)span.start, (unsigned)span.lane, (long)span.msgId);
+            else
+                len = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%ld,\"pid\":1,\"tid\":%u,\"args\":{\"msg_id\":%ld}}",
+                               exported ? ",\n" : "", span.name, (long long)span.start, (long)span.duration, (unsigned)span.lane, (long)span.msgId);
+
+            if (len > 0)
+            {
+                writer(line, (std::size_t)len < sizeof(line) ? (std::size_t)len : sizeof(line) - 1);
+                exported++;
+            }
+        }
+    }
+
+    writer(footer, sizeof(footer) - 1);
+    return exported;
+}
+
+ESP32MQTTTraceScope::ESP32MQTTTraceScope(ESP32MQTTTrace &trace, const char *name, int msgId, uint8_t lane)
+    : _trace(trace), _name(name), _start(trace.enabled() ? esp_timer_get_time() : 0), _msgId(msgId), _lane(lane)
+{
+}
+
+ESP32MQTTTraceScope::~ESP32MQTTTraceScope()
+{
+    if (_trace.enabled())
+        _trace.record(_name, _start, esp_timer_get_time(), _msgId, _lane);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+typedef std::function<void(const char *data, std::size_t length)> TraceWriter;
+
+/*
+ * Fixed-size ring of timestamped spans recorded along the message pipeline (receive, copy, match,
+ * callbacks, publish, enqueue, ack), exported as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ *
+ * Recording is lock free: the MQTT task and publishing tasks claim slots with an atomic counter,
+ * the oldest spans are overwritten. Span names must be string literals.
+ */
+class ESP32MQTTTrace
+{
+public:
+    // Chrome "tid", one lane per side of the client
+    enum Lane : uint8_t
+    {
+        LANE_EVENT = 1,  // MQTT task, onEventCallback()
+        LANE_CALLER = 2, // tasks calling publish()
+        LANE_INBOUND = 3 // inbound task, flow controlled subscriptions
+    };
+
+    struct Span
+    {
+        const char *name;
+        int64_t start;    // esp_timer_get_time(), us
+        int32_t duration; // us, -1 for an instant event
+        int32_t msgId;
+        uint8_t lane;
+    };
+
+    ESP32MQTTTrace() : _next(0) {}
+
+    void enable(std::size_t capacity); // Allocates the ring, must be called before loopStart()
+    inline bool enabled() const { return !_spans.empty(); };
+    void clear();
+
+    void record(const char *name, int64_t start, int64_t end, int msgId, uint8_t lane);
+    void instant(const char *name, int msgId, uint8_t lane);
+
+    std::size_t exportJson(TraceWriter writer) const; // Returns the number of exported spans
+
+private:
+    std::vector<Span> _spans;
+    std::atomic<uint32_t> _next;
+};
+
+/*
+ * Records a span from construction to destruction, does nothing when tracing is off.
+ */
+class ESP32MQTTTraceScope
+{
+public:
+    ESP32MQTTTraceScope(ESP32MQTTTrace &trace, const char *name, int msgId, uint8_t lane);
+    ~ESP32MQTTTraceScope();
+    inline void setMsgId(int msgId) { _msgId = msgId; };
+
+private:
+    ESP32MQTTTrace &_trace;
+    const char *_name;
+    int64_t _start;
+    int _msgId;
+    uint8_t _lane;
+};
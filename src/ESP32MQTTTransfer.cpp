@@ -0,0 +1,566 @@
+#include "ESP32MQTTTransfer.h"
+#include <chrono>
+#include "mbedtls/version.h"
+#include "esp_timer.h"
+
+static const char *TAG = "ESP32MQTTTransfer";
+
+// Wire format, all integers big endian
+static constexpr std::size_t START_SIZE = 43;  // 'S', id, size, chunk size, sha256
+static constexpr std::size_t HEADER_SIZE = 13; // 'D', id, seq, crc32
+static constexpr std::size_t ACK_SIZE = 13;    // status, id, next, bitmap
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// mbedtls 2.x (ESP-IDF 4.x) only has the _ret variants returning an error code
+static void sha256Starts(mbedtls_sha256_context *ctx)
+{
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+    mbedtls_sha256_starts_ret(ctx, 0);
+#else
+    mbedtls_sha256_starts(ctx, 0);
+#endif
+}
+
+static void sha256Update(mbedtls_sha256_context *ctx, const uint8_t *data, std::size_t length)
+{
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+    mbedtls_sha256_update_ret(ctx, data, length);
+#else
+    mbedtls_sha256_update(ctx, data, length);
+#endif
+}
+
+static void sha256Finish(mbedtls_sha256_context *ctx, uint8_t *output)
+{
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+    mbedtls_sha256_finish_ret(ctx, output);
+#else
+    mbedtls_sha256_finish(ctx, output);
+#endif
+}
+
+/**
+ * CRC-32 (IEEE 802.3), nibble table to keep the footprint small
+ *
+ * @param crc is the CRC of the previous data when computing it piecewise
+ */
+uint32_t mqttTransferCrc32(const uint8_t *data, std::size_t length, uint32_t crc)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+    crc = ~crc;
+    for (std::size_t i = 0; i < length; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+// =============== Sources and sinks ==============
+
+std::size_t MemoryTransferSource::read(uint32_t offset, uint8_t *buffer, std::size_t length)
+{
+    if (offset >= _size)
+        return 0;
+    if (length > _size - offset)
+        length = _size - offset;
+    memcpy(buffer, _data + offset, length);
+    return length;
+}
+
+FileTransferSource::FileTransferSource(const char *path)
+{
+    _file = fopen(path, "rb");
+}
+
+FileTransferSource::~FileTransferSource()
+{
+    if (_file != nullptr)
+        fclose(_file);
+}
+
+uint32_t FileTransferSource::size()
+{
+    if (_file == nullptr || fseek(_file, 0, SEEK_END) != 0)
+        return 0;
+    long size = ftell(_file);
+    return size > 0 ? (uint32_t)size : 0;
+}
+
+std::size_t FileTransferSource::read(uint32_t offset, uint8_t *buffer, std::size_t length)
+{
+    if (_file == nullptr || fseek(_file, offset, SEEK_SET) != 0)
+        return 0;
+    return fread(buffer, 1, length, _file);
+}
+
+bool MemoryTransferSink::begin(uint32_t size)
+{
+    _data.clear();
+    _data.reserve(size);
+    return true;
+}
+
+bool MemoryTransferSink::write(const uint8_t *data, std::size_t length)
+{
+    _data.append(reinterpret_cast<const char *>(data), length);
+    return true;
+}
+
+bool MemoryTransferSink::end(bool verified)
+{
+    if (!verified)
+        _data.clear();
+    return true;
+}
+
+bool FileTransferSink::begin(uint32_t /* size */)
+{
+    if (_file != nullptr)
+        fclose(_file);
+    _file = fopen(_path.c_str(), "wb");
+    return _file != nullptr;
+}
+
+bool FileTransferSink::write(const uint8_t *data, std::size_t length)
+{
+    return _file != nullptr && fwrite(data, 1, length, _file) == length;
+}
+
+bool FileTransferSink::end(bool verified)
+{
+    bool success = _file != nullptr && fclose(_file) == 0;
+    _file = nullptr;
+    if (!verified)
+        remove(_path.c_str());
+    return success && verified;
+}
+
+#ifdef ESP_PLATFORM
+bool OtaTransferSink::begin(uint32_t size)
+{
+    _partition = esp_ota_get_next_update_partition(nullptr);
+    if (_partition == nullptr)
+    {
+        ESP_LOGE(TAG, "No OTA partition to write to");
+        return false;
+    }
+    return esp_ota_begin(_partition, size, &_handle) == ESP_OK;
+}
+
+bool OtaTransferSink::write(const uint8_t *data, std::size_t length)
+{
+    return esp_ota_write(_handle, data, length) == ESP_OK;
+}
+
+bool OtaTransferSink::end(bool verified)
+{
+    if (!verified)
+    {
+        esp_ota_abort(_handle);
+        return false;
+    }
+    return esp_ota_end(_handle) == ESP_OK && esp_ota_set_boot_partition(_partition) == ESP_OK;
+}
+#endif
+
+// =============== Sender ==============
+
+ESP32MQTTChunkSender::ESP32MQTTChunkSender(ESP32MQTTClient &client, const std::string &topic)
+    : _client(client), _dataTopic(topic + "/c"), _ackTopic(topic + "/a")
+{
+    _window = DEFAULT_WINDOW;
+    _chunkSize = 0;
+    _retransmitTimeoutMs = DEFAULT_RETRANSMIT_TIMEOUT_MS;
+    memset(&_stats, 0, sizeof(_stats));
+    _id = 0;
+    _ackStatus = 0;
+    _ackNext = 0;
+    _ackBitmap = 0;
+    _ackCount = 0;
+}
+
+bool ESP32MQTTChunkSender::begin()
+{
+    return _client.subscribe(_ackTopic, [this](const std::string &payload)
+                             { onAck(payload); });
+}
+
+void ESP32MQTTChunkSender::setWindow(uint8_t window)
+{
+    _window = window == 0 ? 1 : (window > MAX_WINDOW ? MAX_WINDOW : window);
+}
+
+void ESP32MQTTChunkSender::setChunkSize(uint16_t chunkSize)
+{
+    _chunkSize = chunkSize;
+}
+
+void ESP32MQTTChunkSender::setRetransmitTimeout(uint32_t timeoutMs)
+{
+    _retransmitTimeoutMs = timeoutMs;
+}
+
+// Called from the MQTT task
+void ESP32MQTTChunkSender::onAck(const std::string &payload)
+{
+    if (payload.size() < ACK_SIZE)
+        return;
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(payload.data());
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (get32(p + 1) != _id)
+            return;
+
+        uint32_t next = get32(p + 5);
+        if (_ackStatus == 0 || next >= _ackNext)
+        {
+            _ackStatus = p[0];
+            _ackNext = next;
+            _ackBitmap = get32(p + 9);
+        }
+        _ackCount++;
+    }
+    _ackCondition.notify_one();
+}
+
+bool ESP32MQTTChunkSender::sendChunk(TransferSource &source, std::vector<uint8_t> &buffer, uint32_t seq, uint32_t size, uint16_t chunkSize)
+{
+    uint32_t offset = seq * chunkSize;
+    std::size_t length = size - offset < chunkSize ? size - offset : chunkSize;
+    if (source.read(offset, buffer.data() + HEADER_SIZE, length) != length)
+        return false;
+
+    buffer[0] = 'D';
+    put32(&buffer[1], _id);
+    put32(&buffer[5], seq);
+    put32(&buffer[9], mqttTransferCrc32(buffer.data() + HEADER_SIZE, length));
+    return _client.publish(_dataTopic, buffer.data(), HEADER_SIZE + length, 0, false);
+}
+
+bool ESP32MQTTChunkSender::send(TransferSource &source, uint32_t size, uint32_t timeoutMs)
+{
+    uint16_t chunkSize = _chunkSize;
+    if (chunkSize == 0)
+    {
+        // Output buffer minus fixed header (up to 5 bytes), topic length, topic and chunk header
+        int available = _client.getMaxOutPacketSize() - 5 - 2 - (int)_dataTopic.size() - (int)HEADER_SIZE;
+        if (available <= 0)
+        {
+            ESP_LOGE(TAG, "Output buffer too small for a chunk, see setMaxPacketSize()");
+            return false;
+        }
+        chunkSize = available > 0xFFFF ? 0xFFFF : available;
+    }
+
+    uint32_t chunkCount = (size + chunkSize - 1) / chunkSize;
+    std::vector<uint8_t> buffer(HEADER_SIZE + chunkSize > START_SIZE ? HEADER_SIZE + chunkSize : START_SIZE);
+
+    // SHA-256 of the blob, streamed from the source one chunk at a time
+    uint8_t sha256[32];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    sha256Starts(&sha);
+    for (uint32_t offset = 0; offset < size; offset += chunkSize)
+    {
+        std::size_t length = size - offset < chunkSize ? size - offset : chunkSize;
+        if (source.read(offset, buffer.data(), length) != length)
+        {
+            mbedtls_sha256_free(&sha);
+            ESP_LOGE(TAG, "Transfer source read failed at %u", (unsigned)offset);
+            return false;
+        }
+        sha256Update(&sha, buffer.data(), length);
+    }
+    sha256Finish(&sha, sha256);
+    mbedtls_sha256_free(&sha);
+
+    memset(&_stats, 0, sizeof(_stats));
+    int64_t startUs = esp_timer_get_time();
+    int64_t deadlineUs = startUs + (int64_t)timeoutMs * 1000;
+    std::chrono::milliseconds retransmitTimeout(_retransmitTimeoutMs);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _id = (uint32_t)startUs ^ (uint32_t)(uintptr_t)this;
+    _ackStatus = 0;
+    _ackNext = 0;
+    _ackBitmap = 0;
+    _ackCount = 0;
+
+    // Start message, repeated until the receiver answers
+    uint8_t start[START_SIZE];
+    start[0] = 'S';
+    put32(start + 1, _id);
+    put32(start + 5, size);
+    put16(start + 9, chunkSize);
+    memcpy(start + 11, sha256, sizeof(sha256));
+    while (_ackStatus == 0 && esp_timer_get_time() < deadlineUs)
+    {
+        lock.unlock();
+        _client.publish(_dataTopic, start, START_SIZE, 0, false);
+        lock.lock();
+        _ackCondition.wait_for(lock, retransmitTimeout, [this]
+                               { return _ackStatus != 0; });
+    }
+
+    uint32_t nextToSend = 0;
+    uint32_t fastRetransmitted = UINT32_MAX;
+    while (_ackStatus == 'A' && esp_timer_get_time() < deadlineUs)
+    {
+        uint32_t ackNext = _ackNext;
+        uint32_t ackBitmap = _ackBitmap;
+        uint32_t ackCount = _ackCount;
+        lock.unlock();
+
+        while (nextToSend < chunkCount && nextToSend < ackNext + _window)
+        {
+            sendChunk(source, buffer, nextToSend++, size, chunkSize);
+            _stats.chunksSent++;
+        }
+
+        // Later chunks made it but not the next expected one, resend it once without waiting for the timeout
+        if (ackBitmap != 0 && fastRetransmitted != ackNext)
+        {
+            sendChunk(source, buffer, ackNext, size, chunkSize);
+            _stats.retransmissions++;
+            fastRetransmitted = ackNext;
+        }
+
+        lock.lock();
+        if (_ackCondition.wait_for(lock, retransmitTimeout, [this, ackCount]
+                                   { return _ackCount != ackCount; }))
+            continue;
+
+        // No ack at all within the timeout, resend whatever is in flight and not acknowledged
+        ackNext = _ackNext;
+        ackBitmap = _ackBitmap;
+        lock.unlock();
+        for (uint32_t seq = ackNext; seq < nextToSend; seq++)
+        {
+            if (seq > ackNext && seq - ackNext - 1 < 32 && (ackBitmap >> (seq - ackNext - 1)) & 1)
+                continue;
+            sendChunk(source, buffer, seq, size, chunkSize);
+            _stats.retransmissions++;
+        }
+        lock.lock();
+    }
+
+    bool success = _ackStatus == 'F';
+    _stats.elapsedMs = (esp_timer_get_time() - startUs) / 1000;
+    if (!success)
+        ESP_LOGW(TAG, "Transfer to [%s] failed (%s)", _dataTopic.c_str(), _ackStatus == 'E' ? "rejected by the receiver" : "timeout");
+
+    return success;
+}
+
+// =============== Receiver ==============
+
+ESP32MQTTChunkReceiver::ESP32MQTTChunkReceiver(ESP32MQTTClient &client, const std::string &topic, TransferSink &sink)
+    : _client(client), _sink(sink), _dataTopic(topic + "/c"), _ackTopic(topic + "/a")
+{
+    _window = ESP32MQTTChunkSender::DEFAULT_WINDOW;
+    memset(&_stats, 0, sizeof(_stats));
+    _id = 0;
+    _status = 0;
+    _size = 0;
+    _chunkSize = 0;
+    _chunkCount = 0;
+    _next = 0;
+    _bitmap = 0;
+    memset(_sha256, 0, sizeof(_sha256));
+    mbedtls_sha256_init(&_sha);
+}
+
+ESP32MQTTChunkReceiver::~ESP32MQTTChunkReceiver()
+{
+    mbedtls_sha256_free(&_sha);
+}
+
+bool ESP32MQTTChunkReceiver::begin()
+{
+    return _client.subscribe(_dataTopic, [this](const std::string &payload)
+                             { onChunk(payload); });
+}
+
+void ESP32MQTTChunkReceiver::setWindow(uint8_t window)
+{
+    _window = window == 0 ? 1 : (window > ESP32MQTTChunkSender::MAX_WINDOW ? ESP32MQTTChunkSender::MAX_WINDOW : window);
+}
+
+void ESP32MQTTChunkReceiver::sendAck()
+{
+    uint8_t ack[ACK_SIZE];
+    ack[0] = _status;
+    put32(ack + 1, _id);
+    put32(ack + 5, _next);
+    put32(ack + 9, _bitmap);
+    _client.publish(_ackTopic, ack, ACK_SIZE, 0, false);
+}
+
+void ESP32MQTTChunkReceiver::startTransfer(const uint8_t *data)
+{
+    if (_status == 'A')
+    {
+        // Superseded before it completed
+        _sink.end(false);
+        _stats.transfersFailed++;
+    }
+
+    _id = get32(data + 1);
+    _size = get32(data + 5);
+    _chunkSize = get16(data + 9);
+    memcpy(_sha256, data + 11, sizeof(_sha256));
+    _next = 0;
+    _bitmap = 0;
+    _slots.resize(_window);
+
+    if (_chunkSize == 0 || !_sink.begin(_size))
+    {
+        _status = 'E';
+        _stats.transfersFailed++;
+        return;
+    }
+
+    _chunkCount = (_size + _chunkSize - 1) / _chunkSize;
+    _status = 'A';
+    sha256Starts(&_sha);
+    if (_chunkCount == 0)
+        finishTransfer();
+}
+
+void ESP32MQTTChunkReceiver::finishTransfer()
+{
+    uint8_t sha256[32];
+    sha256Finish(&_sha, sha256);
+    bool verified = memcmp(sha256, _sha256, sizeof(sha256)) == 0;
+    if (!verified)
+        ESP_LOGW(TAG, "Transfer on [%s] failed the SHA-256 check", _dataTopic.c_str());
+
+    if (_sink.end(verified) && verified)
+    {
+        _status = 'F';
+        _stats.transfersCompleted++;
+    }
+    else
+    {
+        _status = 'E';
+        _stats.transfersFailed++;
+    }
+}
+
+// Called from the MQTT task (or the inbound task if the subscription is flow controlled)
+void ESP32MQTTChunkReceiver::onChunk(const std::string &payload)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(payload.data());
+    if (payload.size() < HEADER_SIZE)
+        return;
+
+    if (p[0] == 'S')
+    {
+        if (payload.size() < START_SIZE)
+            return;
+        // A repeated start only means our ack was lost
+        if (get32(p + 1) != _id || _status == 0)
+            startTransfer(p);
+        sendAck();
+        return;
+    }
+
+    if (p[0] != 'D' || get32(p + 1) != _id || _status == 0)
+        return;
+
+    if (_status != 'A')
+    {
+        // Done or failed already, the sender missed the final ack
+        sendAck();
+        return;
+    }
+
+    uint32_t seq = get32(p + 5);
+    const uint8_t *data = p + HEADER_SIZE;
+    std::size_t length = payload.size() - HEADER_SIZE;
+    std::size_t expected = seq + 1 == _chunkCount ? _size - seq * _chunkSize : _chunkSize;
+    if (seq >= _chunkCount || length != expected || mqttTransferCrc32(data, length) != get32(p + 9))
+    {
+        _stats.crcErrors++;
+        return;
+    }
+
+    if (seq < _next)
+    {
+        _stats.duplicates++;
+        sendAck();
+        return;
+    }
+
+    if (seq >= _next + _window)
+        return; // Beyond the window, the sender will send it again
+
+    _stats.chunksReceived++;
+    if (seq > _next)
+    {
+        uint32_t bit = 1u << (seq - _next - 1);
+        if (_bitmap & bit)
+            _stats.duplicates++;
+        else
+            _slots[seq % _window].assign(reinterpret_cast<const char *>(data), length);
+        _bitmap |= bit;
+        sendAck();
+        return;
+    }
+
+    // In order: write it, then whatever was waiting right after it
+    bool written = _sink.write(data, length);
+    sha256Update(&_sha, data, length);
+    _next++;
+    while (written && (_bitmap & 1))
+    {
+        _bitmap >>= 1;
+        const std::string &slot = _slots[_next % _window];
+        written = _sink.write(reinterpret_cast<const uint8_t *>(slot.data()), slot.size());
+        sha256Update(&_sha, reinterpret_cast<const uint8_t *>(slot.data()), slot.size());
+        _next++;
+    }
+    _bitmap >>= 1;
+
+    if (!written)
+    {
+        ESP_LOGW(TAG, "Transfer on [%s] failed writing to the sink", _dataTopic.c_str());
+        _sink.end(false);
+        _status = 'E';
+        _stats.transfersFailed++;
+    }
+    else if (_next == _chunkCount)
+    {
+        finishTransfer();
+    }
+
+    sendAck();
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include "mbedtls/sha256.h"
+#include "ESP32MQTTClient.h"
+#ifdef ESP_PLATFORM
+#include "esp_ota_ops.h"
+#endif
+
+/*
+ * Chunked bulk transfer (firmware images, model files) on top of ESP32MQTTClient.
+ *
+ * The sender splits a blob into sequence numbered chunks sized from the client output buffer and keeps
+ * up to `window` of them unacknowledged. The receiver checks the CRC32 of each chunk, reorders chunks
+ * within its window and streams them in order to a TransferSink, so neither side ever holds the whole
+ * blob. Missing chunks are retransmitted on a gap in the acks or after a timeout, and the SHA-256 of the
+ * blob is verified once the last chunk is written.
+ *
+ *   <topic>/c  sender -> receiver   'S' start: id, size, chunk size, sha256
+ *                                   'D' data:  id, seq, crc32, bytes
+ *   <topic>/a  receiver -> sender   'A' progress / 'F' done / 'E' failed: id, next expected seq,
+ *                                   bitmap of the chunks received after it
+ *
+ * Chunks and acks are published with QoS 0, the window takes care of losses.
+ */
+
+uint32_t mqttTransferCrc32(const uint8_t *data, std::size_t length, uint32_t crc = 0);
+
+// Where the sender reads the blob from, random access so chunks can be retransmitted
+class TransferSource
+{
+public:
+    virtual ~TransferSource() {}
+    virtual std::size_t read(uint32_t offset, uint8_t *buffer, std::size_t length) = 0;
+};
+
+// Where the receiver streams the blob to, in order
+class TransferSink
+{
+public:
+    virtual ~TransferSink() {}
+    virtual bool begin(uint32_t size) = 0;
+    virtual bool write(const uint8_t *data, std::size_t length) = 0;
+    virtual bool end(bool verified) = 0; // Commit when verified, discard otherwise
+};
+
+class MemoryTransferSource : public TransferSource
+{
+public:
+    MemoryTransferSource(const uint8_t *data, std::size_t size) : _data(data), _size(size) {}
+    std::size_t read(uint32_t offset, uint8_t *buffer, std::size_t length) override;
+
+private:
+    const uint8_t *_data;
+    std::size_t _size;
+};
+
+class FileTransferSource : public TransferSource
+{
+public:
+    FileTransferSource(const char *path);
+    ~FileTransferSource();
+    inline bool isOpen() const { return _file != nullptr; };
+    uint32_t size();
+    std::size_t read(uint32_t offset, uint8_t *buffer, std::size_t length) override;
+
+private:
+    FILE *_file;
+};
+
+class MemoryTransferSink : public TransferSink
+{
+public:
+    bool begin(uint32_t size) override;
+    bool write(const uint8_t *data, std::size_t length) override;
+    bool end(bool verified) override;
+    inline const std::string &data() const { return _data; }; // Valid after a verified end()
+
+private:
+    std::string _data;
+};
+
+class FileTransferSink : public TransferSink
+{
+public:
+    FileTransferSink(const char *path) : _path(path), _file(nullptr) {}
+    bool begin(uint32_t size) override;
+    bool write(const uint8_t *data, std::size_t length) override;
+    bool end(bool verified) override; // Removes the file when not verified
+
+private:
+    std::string _path;
+    FILE *_file;
+};
+
+#ifdef ESP_PLATFORM
+// Writes to the next OTA partition and makes it the boot partition once verified
+class OtaTransferSink : public TransferSink
+{
+public:
+    OtaTransferSink() : _partition(nullptr), _handle(0) {}
+    bool begin(uint32_t size) override;
+    bool write(const uint8_t *data, std::size_t length) override;
+    bool end(bool verified) override;
+
+private:
+    const esp_partition_t *_partition;
+    esp_ota_handle_t _handle;
+};
+#endif
+
+class ESP32MQTTChunkSender
+{
+public:
+    static constexpr uint8_t MAX_WINDOW = 32;
+    static constexpr uint8_t DEFAULT_WINDOW = 8;
+    static constexpr uint32_t DEFAULT_RETRANSMIT_TIMEOUT_MS = 1000;
+
+    struct Stats
+    {
+        uint32_t chunksSent;
+        uint32_t retransmissions;
+        uint32_t elapsedMs;
+    };
+
+    ESP32MQTTChunkSender(ESP32MQTTClient &client, const std::string &topic);
+
+    bool begin();                                 // Subscribes to the acks, call it from onMqttConnect()
+    void setWindow(uint8_t window);               // Unacknowledged chunks in flight, up to MAX_WINDOW
+    void setChunkSize(uint16_t chunkSize);        // 0 (default): as large as the client output buffer allows
+    void setRetransmitTimeout(uint32_t timeoutMs);
+
+    // Blocking, call it from a task. Returns true once the receiver verified the blob
+    bool send(TransferSource &source, uint32_t size, uint32_t timeoutMs = 60000);
+    inline const Stats &getStats() const { return _stats; };
+
+private:
+    ESP32MQTTClient &_client;
+    std::string _dataTopic;
+    std::string _ackTopic;
+    uint8_t _window;
+    uint16_t _chunkSize;
+    uint32_t _retransmitTimeoutMs;
+    Stats _stats;
+
+    // Ack state, written by the MQTT task
+    std::mutex _mutex;
+    std::condition_variable _ackCondition;
+    uint32_t _id;
+    char _ackStatus; // 0 until the receiver answered the start message
+    uint32_t _ackNext;
+    uint32_t _ackBitmap;
+    uint32_t _ackCount;
+
+    void onAck(const std::string &payload);
+    bool sendChunk(TransferSource &source, std::vector<uint8_t> &buffer, uint32_t seq, uint32_t size, uint16_t chunkSize);
+};
+
+class ESP32MQTTChunkReceiver
+{
+public:
+    struct Stats
+    {
+        uint32_t chunksReceived;
+        uint32_t duplicates;
+        uint32_t crcErrors;
+        uint32_t transfersCompleted;
+        uint32_t transfersFailed;
+    };
+
+    ESP32MQTTChunkReceiver(ESP32MQTTClient &client, const std::string &topic, TransferSink &sink);
+    ~ESP32MQTTChunkReceiver();
+
+    bool begin();                   // Subscribes to the chunks, call it from onMqttConnect()
+    void setWindow(uint8_t window); // Out of order chunks kept in memory, should match the sender window
+    inline const Stats &getStats() const { return _stats; };
+
+private:
+    ESP32MQTTClient &_client;
+    TransferSink &_sink;
+    std::string _dataTopic;
+    std::string _ackTopic;
+    uint8_t _window;
+    Stats _stats;
+
+    uint32_t _id;
+    char _status; // 0: idle, 'A': receiving, 'F': done, 'E': failed
+    uint32_t _size;
+    uint16_t _chunkSize;
+    uint32_t _chunkCount;
+    uint32_t _next;
+    uint32_t _bitmap; // chunks received after _next, bit 0 is _next + 1
+    uint8_t _sha256[32];
+    mbedtls_sha256_context _sha;
+    std::vector<std::string> _slots;
+
+    void onChunk(const std::string &payload);
+    void startTransfer(const uint8_t *data);
+    void finishTransfer();
+    void sendAck();
+};